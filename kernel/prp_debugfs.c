@@ -0,0 +1,183 @@
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#include <linux/slab.h>
+#include <linux/netdevice.h>
+#include "prp_main.h"
+#include "prp_node.h"
+#include "prp_debugfs.h"
+#include "prp_latency.h"
+#include "prp_stats.h"
+#include "debug.h"
+
+/*
+ * debugfs layout:
+ * 	/sys/kernel/debug/prp/<dev>/node_table_stats
+ * 	/sys/kernel/debug/prp/<dev>/skew	A/B skew of all nodes, see skew_hist
+ * 	/sys/kernel/debug/prp/latency_enable	write 1/0 to start/stop measuring
+ * 	/sys/kernel/debug/prp/latency		histograms; write to reset
+ */
+static struct dentry *prp_debugfs_root;
+
+static int node_table_stats_show(struct seq_file *sf, void *unused)
+{
+	struct prp_priv *priv = sf->private;
+	struct prp_node_table_stats stats;
+	int i;
+
+	prp_node_table_stats(priv, &stats);
+
+	seq_printf(sf, "nodes:     %u\n", stats.nodes);
+	seq_printf(sf, "buckets:   %u\n", stats.buckets);
+	seq_printf(sf, "resizes:   %u\n", stats.resizes);
+	seq_printf(sf, "max chain: %u\n", stats.max_chain);
+	seq_puts(sf, "chain length: buckets\n");
+	for (i = 0; i < PRP_CHAIN_HIST_SIZE - 1; i++)
+		seq_printf(sf, "  %d:  %u\n", i, stats.chain_hist[i]);
+	seq_printf(sf, "  %d+: %u\n", i, stats.chain_hist[i]);
+
+	return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(node_table_stats);
+
+static int skew_show(struct seq_file *sf, void *unused)
+{
+	struct prp_priv *priv = sf->private;
+	u64 (*hist)[PRP_SKEW_BUCKETS];
+	int b;
+
+	hist = kmalloc_array(2, sizeof(*hist), GFP_KERNEL);
+	if (!hist)
+		return -ENOMEM;
+	prp_skew_fold(priv, hist);
+
+	seq_printf(sf, "enabled: %d\n", READ_ONCE(prp_skew_hist));
+	seq_puts(sf, "us: A first, B first\n");
+	for (b = 0; b < PRP_SKEW_BUCKETS - 1; b++)
+		seq_printf(sf, "  < %u: %llu %llu\n", 1U << b,
+			   hist[0][b], hist[1][b]);
+	seq_printf(sf, "  >= %u: %llu %llu\n", 1U << (b - 1),
+		   hist[0][b], hist[1][b]);
+
+	kfree(hist);
+	return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(skew);
+
+/**
+ * prp_debugfs_add_dev - Create the debugfs directory for @prp.
+ * 	Failures are ignored, like for the rest of debugfs.
+ */
+void prp_debugfs_add_dev(struct net_device *prp)
+{
+	struct prp_priv *priv = netdev_priv(prp);
+
+	priv->node_tbl_root = debugfs_create_dir(prp->name, prp_debugfs_root);
+	debugfs_create_file("node_table_stats", 0444, priv->node_tbl_root,
+			    priv, &node_table_stats_fops);
+	debugfs_create_file("skew", 0444, priv->node_tbl_root, priv,
+			    &skew_fops);
+}
+
+void prp_debugfs_del_dev(struct net_device *prp)
+{
+	struct prp_priv *priv = netdev_priv(prp);
+
+	debugfs_remove_recursive(priv->node_tbl_root);
+	priv->node_tbl_root = NULL;
+}
+
+void prp_debugfs_rename_dev(struct net_device *prp)
+{
+	struct prp_priv *priv = netdev_priv(prp);
+
+	if (IS_ERR_OR_NULL(priv->node_tbl_root))
+		return;
+	debugfs_rename(prp_debugfs_root, priv->node_tbl_root,
+		       prp_debugfs_root, prp->name);
+}
+
+static int latency_enable_get(void *data, u64 *val)
+{
+	*val = static_key_enabled(&prp_latency_enabled);
+	return 0;
+}
+
+static int latency_enable_set(void *data, u64 val)
+{
+	prp_latency_enable(val);
+	return 0;
+}
+DEFINE_DEBUGFS_ATTRIBUTE(latency_enable_fops, latency_enable_get,
+			 latency_enable_set, "%llu\n");
+
+static int latency_show(struct seq_file *sf, void *unused)
+{
+	struct prp_lat_hist *hist;
+	u64 n, total;
+	int s, b;
+
+	/* Too large for the stack */
+	hist = kmalloc(sizeof(*hist), GFP_KERNEL);
+	if (!hist)
+		return -ENOMEM;
+	prp_latency_fold(hist);
+
+	seq_printf(sf, "enabled: %d\n", static_key_enabled(&prp_latency_enabled));
+	for (s = 0; s < __PRP_LAT_MAX; s++) {
+		total = 0;
+		for (b = 0; b < PRP_LAT_BUCKETS; b++)
+			total += hist->count[s][b];
+		seq_printf(sf, "%s: %llu samples\n", prp_lat_stage_names[s],
+			   total);
+		if (!total)
+			continue;
+		seq_puts(sf, "  cycles: samples\n");
+		for (b = 0; b < PRP_LAT_BUCKETS; b++) {
+			n = hist->count[s][b];
+			if (!n)
+				continue;
+			if (b == PRP_LAT_BUCKETS - 1)
+				seq_printf(sf, "  >= %llu: %llu\n", 1ULL << (b - 1), n);
+			else
+				seq_printf(sf, "  < %llu: %llu\n", 1ULL << b, n);
+		}
+	}
+
+	kfree(hist);
+	return 0;
+}
+
+static int latency_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, latency_show, inode->i_private);
+}
+
+static ssize_t latency_write(struct file *file, const char __user *buf,
+			     size_t count, loff_t *ppos)
+{
+	prp_latency_reset();
+	return count;
+}
+
+static const struct file_operations latency_fops = {
+	.owner		= THIS_MODULE,
+	.open		= latency_open,
+	.read		= seq_read,
+	.llseek		= seq_lseek,
+	.write		= latency_write,
+	.release	= single_release,
+};
+
+void prp_debugfs_init(void)
+{
+	prp_debugfs_root = debugfs_create_dir("prp", NULL);
+	debugfs_create_file_unsafe("latency_enable", 0600, prp_debugfs_root,
+				   NULL, &latency_enable_fops);
+	debugfs_create_file("latency", 0600, prp_debugfs_root, NULL,
+			    &latency_fops);
+}
+
+void prp_debugfs_exit(void)
+{
+	debugfs_remove_recursive(prp_debugfs_root);
+}
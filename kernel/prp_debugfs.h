@@ -0,0 +1,13 @@
+#ifndef __PRP_DEBUGFS_H
+#define __PRP_DEBUGFS_H
+
+#include <linux/netdevice.h>
+
+void prp_debugfs_init(void);
+void prp_debugfs_exit(void);
+
+void prp_debugfs_add_dev(struct net_device *prp);
+void prp_debugfs_del_dev(struct net_device *prp);
+void prp_debugfs_rename_dev(struct net_device *prp);
+
+#endif /* __PRP_DEBUGFS_H */
@@ -1,15 +1,20 @@
 #include <linux/netdevice.h>
 #include <linux/etherdevice.h>
 #include <linux/if_vlan.h>
-#include <linux/timer.h>
 #include <asm/current.h>
 #include "prp_main.h"
 #include "prp_dev.h"
 #include "prp_node.h"
 #include "prp_tx.h"
 #include "prp_rx.h"
+#include "prp_debugfs.h"
+#include "prp_stats.h"
+#include "prp_event.h"
+#include "prp_sched.h"
 #include "debug.h"
 
+static int prp_dev_init(struct net_device *dev);
+static void prp_dev_uninit(struct net_device *dev);
 static int prp_dev_open(struct net_device *dev);
 static int prp_dev_change_mtu(struct net_device *dev, int mtu);
 static int prp_dev_close(struct net_device *dev);
@@ -69,6 +74,69 @@ static int prp_dev_change_mtu(struct net_device *dev, int mtu)
 	return 0;
 }
 
+/* Called from register_netdevice() */
+static int prp_dev_init(struct net_device *dev)
+{
+	struct prp_priv *priv = netdev_priv(dev);
+	int res;
+
+	/* Freed by prp_dev_free(), which register_netdevice() also calls if
+	 * it fails after ndo_init; so it is set up here and not before
+	 * registering, where a failure would leak it. */
+	res = prp_init_node_table(priv);
+	if (res) {
+		printk(KERN_ERR "[prp] %s: failed to initialise node table\n",
+			__func__);
+		return res;
+	}
+
+	priv->pcpu_stats = netdev_alloc_pcpu_stats(struct prp_pcpu_stats);
+	if (!priv->pcpu_stats) {
+		res = -ENOMEM;
+		goto err_stats;
+	}
+
+	res = prp_events_init(dev);
+	if (res)
+		goto err_events;
+
+	prp_sup_queue_init(dev);
+	res = prp_rx_cells_init(dev);
+	if (res)
+		goto err_rx_cells;
+
+	res = prp_tx_batches_init(dev);
+	if (res)
+		goto err_tx_batches;
+	return 0;
+
+err_tx_batches:
+	prp_rx_cells_destroy(dev);
+err_rx_cells:
+	prp_events_destroy(dev);
+err_events:
+	free_percpu(priv->pcpu_stats);
+	priv->pcpu_stats = NULL;
+err_stats:
+	/* ndo_init failed: register_netdevice() does not call the destructor */
+	prp_del_node_table(priv);
+	return res;
+}
+
+/* Called on unregister, once the device can no longer be used */
+static void prp_dev_uninit(struct net_device *dev)
+{
+	struct prp_priv *priv = netdev_priv(dev);
+
+	prp_sup_free(dev);
+	prp_tx_batches_destroy(dev);
+	prp_rx_cells_destroy(dev);
+	prp_sup_queue_destroy(dev);
+	prp_events_destroy(dev);
+	free_percpu(priv->pcpu_stats);
+	priv->pcpu_stats = NULL;
+}
+
 /**
  * Called when network device transitions to the UP state.
  * Check if both slave devices are up - warn if not
@@ -94,9 +162,47 @@ static int prp_dev_close(struct net_device *dev)
 	return 0;
 }
 
-/* Transmit packet */
+/**
+ * prp_xmit_gso - Segment a GSO frame and send each segment through both
+ * 	slaves. The RCT carries the LSDU size and its own sequence number, so
+ * 	the slaves cannot segment for us; we do it once here, which still
+ * 	saves the trips through the stack for every segment.
+ */
+static void prp_xmit_gso(struct sk_buff *skb, struct net_device *dev,
+			 struct prp_tx_batch *b)
+{
+	struct sk_buff *segs, *next;
+
+	/* Keep SG and checksum offload: segments share the pages, and the
+	 * checksums are done in prp_queue_skb() */
+	segs = skb_gso_segment(skb, dev->features & ~NETIF_F_GSO_MASK);
+	if (IS_ERR(segs)) {
+		dev_core_stats_tx_dropped_inc(dev);
+		kfree_skb(skb);
+		return;
+	}
+	if (!segs) {
+		prp_queue_skb(skb, dev, b);
+		return;
+	}
+	consume_skb(skb);
+
+	skb_list_walk_safe(segs, skb, next) {
+		skb_mark_not_on_list(skb);
+		prp_queue_skb(skb, dev, b);
+	}
+}
+
+/**
+ * prp_dev_xmit - Queue the copies of @skb on this CPU's TX batch. The batch
+ * 	is handed to the slaves once the core has no more frames for us, so
+ * 	a burst, and all segments of a GSO frame, reach each slave together.
+ */
 static netdev_tx_t prp_dev_xmit(struct sk_buff *skb, struct net_device *dev)
 {
+	struct prp_priv *priv = netdev_priv(dev);
+	struct prp_tx_batch *b = this_cpu_ptr(priv->tx_batches);
+
 	// PDEBUG("%s: PID=%d, dev=%s\n", __func__, current->pid, dev->name);
 
 	skb_reset_mac_header(skb);
@@ -106,11 +212,55 @@ static netdev_tx_t prp_dev_xmit(struct sk_buff *skb, struct net_device *dev)
 	 */
 	ether_addr_copy(eth_hdr(skb)->h_source, dev->dev_addr);
 	/* Forward to be sent through both slave devices */
-	prp_send_skb(skb, dev);
+	if (skb_is_gso(skb))
+		prp_xmit_gso(skb, dev, b);
+	else
+		prp_queue_skb(skb, dev, b);
+	if (!netdev_xmit_more())
+		prp_tx_flush(b, dev);
 
 	return NETDEV_TX_OK;
 }
 
+/**
+ * prp_vlan_rx_add_vid - A VLAN device was added on top of the master; add the
+ * 	VLAN to the receive filter of both slaves.
+ * 	Also called for the same device twice if both slaves are the same; the
+ * 	VLAN is then added twice and prp_del_port() drops both references.
+ */
+static int prp_vlan_rx_add_vid(struct net_device *dev, __be16 proto, u16 vid)
+{
+	struct prp_priv *priv = netdev_priv(dev);
+	struct prp_port *ports = priv->ports;
+	int res;
+
+	if (!ports[0].dev || !ports[1].dev)
+		return -ENODEV;
+
+	res = vlan_vid_add(ports[0].dev, proto, vid);
+	if (res)
+		return res;
+	res = vlan_vid_add(ports[1].dev, proto, vid);
+	if (res) {
+		vlan_vid_del(ports[0].dev, proto, vid);
+		return res;
+	}
+	return 0;
+}
+
+static int prp_vlan_rx_kill_vid(struct net_device *dev, __be16 proto, u16 vid)
+{
+	struct prp_priv *priv = netdev_priv(dev);
+	struct prp_port *ports = priv->ports;
+
+	/* Slaves already removed on dellink drop their VLANs themselves */
+	for (int i = 0; i < 2; i++) {
+		if (ports[i].dev)
+			vlan_vid_del(ports[i].dev, proto, vid);
+	}
+	return 0;
+}
+
 /*
  * Adjust requested feature flags and return the resulting flags.
  * Must not modify the device state
@@ -122,10 +272,15 @@ static netdev_tx_t prp_dev_xmit(struct sk_buff *skb, struct net_device *dev)
 // }
 
 static const struct net_device_ops prp_device_ops = {
+	.ndo_init = prp_dev_init,
+	.ndo_uninit = prp_dev_uninit,
 	.ndo_change_mtu = prp_dev_change_mtu,
 	.ndo_open = prp_dev_open,
 	.ndo_stop = prp_dev_close,
 	.ndo_start_xmit = prp_dev_xmit,
+	.ndo_get_stats64 = prp_get_stats64,
+	.ndo_vlan_rx_add_vid = prp_vlan_rx_add_vid,
+	.ndo_vlan_rx_kill_vid = prp_vlan_rx_kill_vid,
 	// .ndo_fix_features = prp_fix_features,
 };
 
@@ -134,6 +289,17 @@ static const struct header_ops prp_header_ops = {
 	.parse	= eth_header_parse,
 };
 
+/**
+ * prp_dev_free - Device destructor, called once the device is unregistered and
+ * 	nothing can reach the node table anymore.
+ */
+static void prp_dev_free(struct net_device *dev)
+{
+	struct prp_priv *priv = netdev_priv(dev);
+
+	prp_del_node_table(priv);
+}
+
 /* Called from rtnl_link_ops. */
 void prp_dev_setup(struct net_device *dev)
 {
@@ -141,21 +307,38 @@ void prp_dev_setup(struct net_device *dev)
 	ether_setup(dev);
 	dev->netdev_ops = &prp_device_ops;
 	dev->header_ops = &prp_header_ops;
+	dev->ethtool_ops = &prp_ethtool_ops;
 
 	SET_NETDEV_DEVTYPE(dev, &prp_type);
 	dev->priv_flags |= IFF_NO_QUEUE | IFF_DISABLE_NETPOLL;
 	dev->needs_free_netdev = true;		/* unregister should perform free_netdev */
+	dev->priv_destructor = prp_dev_free;
+	/* Room for the RCT, see prp_put_rct() */
+	dev->needed_tailroom = PRP_RCTLEN;
 	dev->hw_features = NETIF_F_SG		/* Scatter/gather IO */
 			| NETIF_F_FRAGLIST 	/* Scatter/gather IO */
 			| NETIF_F_HIGHDMA	/* Can DMA to high memory */
 			| NETIF_F_GSO_MASK 	/* Segmentation offload feature mask */
 			| NETIF_F_HW_CSUM 	/* Can checksum all packets */
 			;
+	/* HW_CSUM is only there because SG and GSO need a checksum feature.
+	 * Frames with an RCT are checksummed in software by prp_queue_skb()
+	 * before the RCT goes on, since the slaves would include it; only
+	 * frames to a SAN, which have no RCT, are checksummed by the slave.
+	 */
+	/* Inherited by VLAN devices on top of us */
+	dev->vlan_features = dev->hw_features;
+	/* VLAN tags stay in skb metadata all the way to the slaves, which
+	 * insert them in hardware on both copies, with the same PCP. On RX the
+	 * slave or the core has already moved the tag out of the frame.
+	 */
+	dev->hw_features |= NETIF_F_HW_VLAN_CTAG_TX;
 	dev->features = dev->hw_features;
-	// /* prevent recursive tx locking? */
-	// dev->features |= NETIF_F_LLTX;
-	/* cannot handle VLAN */
-	dev->features |= NETIF_F_VLAN_CHALLENGED;
+	/* Pass VLANs configured on top of us to the slaves' filters */
+	dev->features |= NETIF_F_HW_VLAN_CTAG_FILTER;
+	/* prp_dev_xmit() only touches per-CPU state and the atomic seqnr; no
+	 * need for the core to serialise it per TX queue */
+	dev->features |= NETIF_F_LLTX;
 	/* "Does not change network namespaces" */
 	dev->features |= NETIF_F_NETNS_LOCAL;
 
@@ -230,21 +413,44 @@ int prp_slave_ok(struct net_device *dev, struct netlink_ext_ack *extack)
 		return -EINVAL;
 	}
 
+	if (is_vlan_dev(dev)) {
+		pr_info("Device %s is a VLAN dev\n", dev->name);
+		NL_SET_ERR_MSG_MOD(extack, "Cannot use a VLAN device as a slave");
+		return -EINVAL;
+	}
+
 	// if (dev->priv_flags & IFF_DONT_BRIDGE) {
 	// 	PDEBUG("Device %s doe not support bridging\n", dev->name);
 	// 	NL_SET_ERR_MSG_MOD(extack, "Device does not support bridging");
 	// 	return -EOPNOTSUPP;
 	// }
 
-	if (is_vlan_dev(dev)) {
-		pr_info("Device %s is a VLAN dev\n", dev->name);
-		NL_SET_ERR_MSG_MOD(extack, "Does not support VLAN yet");
-		return -EINVAL;
-	}
-
 	return 0;
 }
 
+/**
+ * prp_set_tx_queues - Use as many TX queues as the slave with the most.
+ * 	Frames sent directly to a slave's driver keep the queue the core
+ * 	picked on the master, see prp_slave_txq(). Frames that go through
+ * 	dev_queue_xmit(), i.e, to a slave queue with a qdisc, get their
+ * 	queue picked again by the slave, which overrides any queue_mapping:
+ * 	by XPS on the CPU that flushes the batch, by the socket's cached
+ * 	queue for the LAN B copy, which keeps the socket, or by the flow
+ * 	hash. The two copies of a flow may then use different queues.
+ * 	Called under RTNL.
+ */
+void prp_set_tx_queues(struct net_device *prp)
+{
+	struct prp_priv *priv = netdev_priv(prp);
+	unsigned int n;
+
+	n = max(priv->ports[0].dev->real_num_tx_queues,
+		priv->ports[1].dev->real_num_tx_queues);
+	n = clamp(n, 1U, prp->num_tx_queues);
+	if (netif_set_real_num_tx_queues(prp, n))
+		netdev_warn(prp, "failed to use %u TX queues\n", n);
+}
+
 /**
  * prp_add_ports - Add the 2 slave devices to prp_priv
  * 	Returns 0 on success, -1 on failure
@@ -297,54 +503,17 @@ void prp_del_port(struct prp_port *port)
 	if (!port->dev)
 		return;
 	// PDEBUG("%s: dev='%s'", __func__, port->dev->name);
+	vlan_vids_del_by_dev(port->dev, port->master);
 	dev_set_promiscuity(port->dev, -1);
 	netdev_rx_handler_unregister(port->dev);
 	netdev_upper_dev_unlink(port->dev, port->master);
 	port->dev = NULL;
 }
 
-static void prp_dump_node_table(struct prp_priv *priv)
-{
-	struct node_entry *curr;
-	int i;
-
-	read_lock(&priv->node_table_lock);
-	hash_for_each(priv->node_table, i, curr, list) {
-		unsigned char *mac = curr->mac;
-		pr_info("%s: %02x:%02x:%02x:%02x:%02x:%02x"
-			"san_a=%d, san_b=%d\n", __func__,
-			mac[0], mac[1], mac[2], mac[3], mac[4], mac[5],
-			curr->san_a, curr->san_b);
-	}
-	read_unlock(&priv->node_table_lock);
-}
-
-static void prp_sup_timer(struct timer_list *t)
-{
-	struct prp_priv *priv;
-	struct net_device *prp;
-
-	/* Get container of t */
-	priv = from_timer(priv, t, sup_timer);
-	prp = priv->ports[0].master;
-
-	/* for debugging */
-#ifdef PRP_DEBUG
-	prp_dump_node_table(priv);
-#endif
-
-	prp_send_supervision(prp);
-	/* Reset timer */
-	if (prp->flags & IFF_UP)
-		mod_timer(&priv->sup_timer,
-			  jiffies + msecs_to_jiffies(LIFE_CHECK_INTERVAL));
-}
-
 /* Registers net_device for prp. */
 int prp_dev_finalize(struct net_device *prp, struct net_device *slave[2],
 		     struct netlink_ext_ack *extack)
 {
-	struct rtnl_link_stats64 *stats;
 	struct prp_priv *priv = netdev_priv(prp);
 	int ret = 0;
 
@@ -354,22 +523,11 @@ int prp_dev_finalize(struct net_device *prp, struct net_device *slave[2],
 	atomic_set(&priv->sup_seqnr, 0);
 	atomic_set(&priv->seqnr, 0);
 
-	rwlock_init(&priv->node_table_lock);
-
-	timer_setup(&priv->sup_timer, prp_sup_timer, 0);
-	timer_setup(&priv->prune_timer, prp_prune_nodes, 0);
+	spin_lock_init(&priv->sup_lock);
 
 	/* May need to provide parameter for last byte of mcast addr */
 	ether_addr_copy(priv->sup_multicast_addr, prp_def_multicast_addr);
 
-	stats = kmalloc(sizeof(*stats), GFP_KERNEL);
-	if (!stats) {
-		printk(KERN_ERR "[prp] %s: failed to allocate rtnl_link_stats64\n",
-			__func__);
-		return -1;
-	}
-	priv->stats = stats;
-
 	/* Register our new device */
 	netif_carrier_off(prp);		// why?
 	ret = register_netdevice(prp);
@@ -387,19 +545,26 @@ int prp_dev_finalize(struct net_device *prp, struct net_device *slave[2],
 	}
 
 	dev_set_mtu(prp, prp_get_max_mtu(priv->ports));
+	prp_set_tx_queues(prp);
 
-	/* TODO:
-	 * 	Set up sysfs entry for node table
-	 */
+	/* After the ports, for their LAN ids */
+	ret = prp_sup_rebuild(prp);
+	if (ret) {
+		printk(KERN_ERR "%s: failed to build supervision frames",
+			__func__);
+		goto err_del_ports;
+	}
 
-	/* initialise node table */
-	prp_init_node_table(priv);
+	prp_debugfs_add_dev(prp);
 
-	mod_timer(&priv->prune_timer,
-			jiffies + msecs_to_jiffies(PRUNE_PERIOD));
+	/* Supervision frames and pruning from here on */
+	prp_sched_add(priv);
 
 	return 0;
 
+err_del_ports:
+	prp_del_port(&priv->ports[0]);
+	prp_del_port(&priv->ports[1]);
 err_unregister:
 	unregister_netdevice(prp);
 
@@ -417,19 +582,15 @@ static void prp_set_operstate(struct net_device *dev, int state)
 }
 
 /**
- * prp_set_sup_timer - Initialise or delete timer for supervision frame.
- * 	Initialise timer when state changes from DOWN -> UP
- * 	Delete time when when state changes from UP -> DOWN
+ * prp_set_sup_active - Start or stop sending supervision frames.
+ * 	They are sent while the master is operationally UP, by the module
+ * 	wide supervision work, see prp_sched.c.
  */
-void prp_set_sup_timer(struct net_device *prp, unsigned char old_operstate)
+static void prp_set_sup_active(struct net_device *prp)
 {
 	struct prp_priv *priv = netdev_priv(prp);
 
-	if (prp->operstate == IF_OPER_UP && old_operstate == IF_OPER_DOWN)
-		mod_timer(&priv->sup_timer,
-			  jiffies + msecs_to_jiffies(LIFE_CHECK_INTERVAL));
-	else if (prp->operstate == IF_OPER_DOWN && old_operstate == IF_OPER_UP)
-		del_timer(&priv->sup_timer);
+	WRITE_ONCE(priv->sup_active, prp->operstate == IF_OPER_UP);
 }
 
 /**
@@ -441,11 +602,9 @@ void prp_check_carrier_and_operstate(struct net_device *prp)
 {
 	struct prp_priv *priv = netdev_priv(prp);
 	struct prp_port *ports = priv->ports;
-	unsigned char old_operstate;
 
 	ASSERT_RTNL();
 
-	old_operstate = prp->operstate;
 	/* netif_carrier_on if atleast one slave is up */
 	if (is_up(ports[0].dev) || is_up(ports[1].dev)) {
 		netif_carrier_on(prp);
@@ -460,5 +619,5 @@ void prp_check_carrier_and_operstate(struct net_device *prp)
 		else
 			prp_set_operstate(prp, IF_OPER_DOWN);
 	}
-	prp_set_sup_timer(prp, old_operstate);
+	prp_set_sup_active(prp);
 }
@@ -18,6 +18,8 @@ int prp_dev_finalize(struct net_device *dev, struct net_device *slave[2],
 
 int prp_get_max_mtu(struct prp_port ports[2]);
 
+void prp_set_tx_queues(struct net_device *prp);
+
 /* Called from dellink */
 void prp_del_port(struct prp_port *port);
 
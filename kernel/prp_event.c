@@ -0,0 +1,103 @@
+#include <linux/netdevice.h>
+#include <linux/etherdevice.h>
+#include <linux/slab.h>
+#include "prp_main.h"
+#include "prp_netlink.h"
+#include "prp_event.h"
+#include "debug.h"
+
+/**
+ * prp_event_work - Send the queued events, PRP_EVENT_BATCH per message.
+ * 	The lock is only held to copy a batch out of the ring.
+ */
+static void prp_event_work(struct work_struct *work)
+{
+	struct prp_event_queue *q = container_of(work, struct prp_event_queue,
+						 work);
+	struct prp_event batch[PRP_EVENT_BATCH];
+	unsigned int n;
+	bool overflow;
+
+	for (;;) {
+		spin_lock_bh(&q->lock);
+		n = min_t(unsigned int, q->len, PRP_EVENT_BATCH);
+		for (unsigned int i = 0; i < n; i++)
+			batch[i] = q->ev[(q->head + i) % PRP_EVENT_QUEUE_LEN];
+		q->head = (q->head + n) % PRP_EVENT_QUEUE_LEN;
+		q->len -= n;
+		overflow = q->overflow;
+		q->overflow = false;
+		spin_unlock_bh(&q->lock);
+
+		if (!n && !overflow)
+			break;
+		prp_genl_send_events(q->dev, batch, n, overflow);
+		cond_resched();
+	}
+}
+
+/**
+ * prp_queue_event - Queue an event for the events multicast group.
+ * 	Does nothing if nobody is listening. Can be called from softirq.
+ * @mac: Node the event is about
+ * @state: PRP_NODE_*, for PRP_EVENT_NODE_ADD and _STATE
+ * @lan: 0xA or 0xB, for PRP_EVENT_LAN_LOST and _RESTORED
+ */
+void prp_queue_event(struct prp_priv *priv, u8 type, const unsigned char *mac,
+		     u8 state, u8 lan)
+{
+	struct prp_event_queue *q = priv->events;
+	struct prp_event *ev;
+	bool kick;
+
+	if (!prp_genl_has_listeners(q->dev))
+		return;
+
+	spin_lock_bh(&q->lock);
+	if (unlikely(q->len == PRP_EVENT_QUEUE_LEN)) {
+		q->overflow = true;
+		spin_unlock_bh(&q->lock);
+		return;
+	}
+	ev = &q->ev[(q->head + q->len) % PRP_EVENT_QUEUE_LEN];
+	ev->type = type;
+	ev->state = state;
+	ev->lan = lan;
+	ether_addr_copy(ev->mac, mac);
+	kick = q->len++ == 0;
+	spin_unlock_bh(&q->lock);
+
+	if (kick)
+		schedule_work(&q->work);
+}
+
+/* Called from ndo_init */
+int prp_events_init(struct net_device *prp)
+{
+	struct prp_priv *priv = netdev_priv(prp);
+	struct prp_event_queue *q;
+
+	q = kzalloc(sizeof(*q), GFP_KERNEL);
+	if (!q)
+		return -ENOMEM;
+	q->dev = prp;
+	spin_lock_init(&q->lock);
+	INIT_WORK(&q->work, prp_event_work);
+	priv->events = q;
+	return 0;
+}
+
+/**
+ * prp_events_destroy - Called from ndo_uninit, after the RX cells are gone,
+ * 	so nothing can queue events anymore. Pending events are sent.
+ */
+void prp_events_destroy(struct net_device *prp)
+{
+	struct prp_priv *priv = netdev_priv(prp);
+
+	if (!priv->events)
+		return;
+	flush_work(&priv->events->work);
+	kfree(priv->events);
+	priv->events = NULL;
+}
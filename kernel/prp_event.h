@@ -0,0 +1,46 @@
+#ifndef __PRP_EVENT_H
+#define __PRP_EVENT_H
+
+#include <linux/netdevice.h>
+#include <linux/spinlock.h>
+#include <linux/workqueue.h>
+#include "prp_main.h"
+
+/* A node table change, see PRP_EVENT_* in prp_genl.h */
+struct prp_event {
+	u8		type;
+	u8		state;		/* PRP_NODE_* */
+	u8		lan;		/* 0xA or 0xB */
+	unsigned char	mac[ETH_ALEN];
+};
+
+/* Events kept per device until the work sends them */
+#define PRP_EVENT_QUEUE_LEN	1024
+/* Events per netlink message; fits in NLMSG_GOODSIZE */
+#define PRP_EVENT_BATCH		32
+
+/**
+ * struct prp_event_queue - Ring of events waiting to be multicast.
+ * 	Events are queued from RX and the prune work, and sent from @work in
+ * 	messages of up to PRP_EVENT_BATCH events, so that a burst of node
+ * 	table changes costs a few messages instead of one each.
+ * @overflow: The ring was full and events were dropped.
+ */
+struct prp_event_queue {
+	struct net_device	*dev;
+	spinlock_t		lock;
+	unsigned int		head;
+	unsigned int		len;
+	bool			overflow;
+	struct work_struct	work;
+	struct prp_event	ev[PRP_EVENT_QUEUE_LEN];
+};
+
+int prp_events_init(struct net_device *prp);
+
+void prp_events_destroy(struct net_device *prp);
+
+void prp_queue_event(struct prp_priv *priv, u8 type, const unsigned char *mac,
+		     u8 state, u8 lan);
+
+#endif /* __PRP_EVENT_H */
@@ -0,0 +1,81 @@
+#ifndef __PRP_GENL_H
+#define __PRP_GENL_H
+
+/*
+ * Generic netlink family "PRP". Shared with userspace, like prp_link.h.
+ *
+ * PRP_C_GET_NODE_LIST (dump only) takes PRP_A_IFINDEX of the PRP device and
+ * returns one message per node table entry with the PRP_A_NODE_* attributes.
+ *
+ * PRP_C_NODE_EVENT is sent to the "events" multicast group when the node
+ * table changes. Each message carries PRP_A_IFINDEX and one or more nested
+ * PRP_A_EVENT attributes, oldest first, each with PRP_A_EVENT_TYPE,
+ * PRP_A_NODE_MAC, and PRP_A_NODE_STATE or PRP_A_EVENT_LAN depending on the
+ * type. After PRP_EVENT_OVERFLOW, events were dropped; dump the node table
+ * to resynchronise.
+ */
+#define PRP_GENL_NAME		"PRP"
+#define PRP_GENL_VERSION	1
+#define PRP_GENL_MCGRP_EVENTS	"events"
+
+/*
+ * Buckets of the LAN A/B skew histograms: time between the first and the
+ * second copy of a frame. Bucket 0 counts less than 1 us, bucket i counts
+ * [2^(i-1), 2^i) us, and the last bucket everything from 2^(i-1) us up.
+ */
+#define PRP_SKEW_BUCKETS	24
+
+enum {
+	PRP_C_UNSPEC,
+	PRP_C_GET_NODE_LIST,
+	PRP_C_NODE_EVENT,
+
+	__PRP_C_MAX,
+};
+#define PRP_C_MAX (__PRP_C_MAX - 1)
+
+/* Values for PRP_A_NODE_STATE */
+enum {
+	PRP_NODE_NEW,		/* nothing but PRP data frames seen yet */
+	PRP_NODE_SAN_A,		/* SAN on LAN A */
+	PRP_NODE_SAN_B,		/* SAN on LAN B */
+	PRP_NODE_DANP,		/* sent supervision frames */
+};
+
+/* Values for PRP_A_EVENT_TYPE */
+enum {
+	PRP_EVENT_NODE_ADD,	/* with PRP_A_NODE_STATE */
+	PRP_EVENT_NODE_DEL,
+	PRP_EVENT_NODE_STATE,	/* SAN/DANP changed; with PRP_A_NODE_STATE */
+	PRP_EVENT_LAN_LOST,	/* DANP silent on PRP_A_EVENT_LAN only */
+	PRP_EVENT_LAN_RESTORED,	/* heard on PRP_A_EVENT_LAN again */
+	PRP_EVENT_OVERFLOW,	/* events were dropped before this one */
+};
+
+enum {
+	PRP_A_UNSPEC,
+	PRP_A_IFINDEX,			/* u32 */
+	PRP_A_NODE_MAC,			/* binary, ETH_ALEN */
+	PRP_A_NODE_STATE,		/* u8, PRP_NODE_* */
+	PRP_A_NODE_LAST_SEEN_A,		/* u32, ms since the last frame on LAN A */
+	PRP_A_NODE_LAST_SEEN_B,		/* u32, ms since the last frame on LAN B */
+	PRP_A_NODE_DUPLICATES,		/* u64, duplicates discarded */
+	PRP_A_NODE_LOST,		/* not sent anymore, see PRP_A_NODE_LOST_A */
+	PRP_A_NODE_WINDOW_SIZE,		/* u32, seqnrs remembered; 0 if none */
+	PRP_A_NODE_WINDOW_SEEN,		/* u32, seqnrs in the window received */
+	PRP_A_PAD,
+	PRP_A_EVENT,			/* nested */
+	PRP_A_EVENT_TYPE,		/* u8, PRP_EVENT_* */
+	PRP_A_EVENT_LAN,		/* u8, 0xA or 0xB */
+	PRP_A_NODE_SKEW_A_FIRST,	/* u32[PRP_SKEW_BUCKETS], B copy late */
+	PRP_A_NODE_SKEW_B_FIRST,	/* u32[PRP_SKEW_BUCKETS], A copy late */
+	PRP_A_NODE_LOST_A,		/* u64, seqnrs received on LAN B only */
+	PRP_A_NODE_LOST_B,		/* u64, seqnrs received on LAN A only */
+	PRP_A_NODE_OUT_OF_ORDER_A,	/* u64, frames reordered on LAN A */
+	PRP_A_NODE_OUT_OF_ORDER_B,	/* u64, frames reordered on LAN B */
+
+	__PRP_A_MAX,
+};
+#define PRP_A_MAX (__PRP_A_MAX - 1)
+
+#endif /* __PRP_GENL_H */
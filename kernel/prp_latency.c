@@ -0,0 +1,55 @@
+#include <linux/percpu.h>
+#include <linux/string.h>
+#include "prp_latency.h"
+
+DEFINE_STATIC_KEY_FALSE(prp_latency_enabled);
+DEFINE_PER_CPU(struct prp_lat_hist, prp_lat_hist);
+
+const char * const prp_lat_stage_names[__PRP_LAT_MAX] = {
+	[PRP_LAT_RX_CLASSIFY]		= "rx_classify",
+	[PRP_LAT_RX_NODE_LOOKUP]	= "rx_node_lookup",
+	[PRP_LAT_RX_LOCK_WAIT]		= "rx_lock_wait",
+	[PRP_LAT_RX_REGISTER]		= "rx_register",
+	[PRP_LAT_RX_SUP]		= "rx_supervision",
+	[PRP_LAT_RX_DELIVER]		= "rx_deliver",
+	[PRP_LAT_TX_NODE_LOOKUP]	= "tx_node_lookup",
+	[PRP_LAT_TX_COPY]		= "tx_copy",
+	[PRP_LAT_TX_XMIT]		= "tx_xmit",
+};
+
+/* Called from process context, i.e, debugfs */
+void prp_latency_enable(bool enable)
+{
+	if (enable)
+		static_branch_enable(&prp_latency_enabled);
+	else
+		static_branch_disable(&prp_latency_enabled);
+}
+
+/**
+ * prp_latency_fold - Sum up the histograms of all CPUs into @total.
+ * 	Counters are read without synchronisation; a reading may be off by
+ * 	the frames being counted right now.
+ */
+void prp_latency_fold(struct prp_lat_hist *total)
+{
+	int cpu;
+
+	memset(total, 0, sizeof(*total));
+	for_each_possible_cpu(cpu) {
+		const struct prp_lat_hist *h = per_cpu_ptr(&prp_lat_hist, cpu);
+
+		for (int s = 0; s < __PRP_LAT_MAX; s++)
+			for (int b = 0; b < PRP_LAT_BUCKETS; b++)
+				total->count[s][b] += READ_ONCE(h->count[s][b]);
+	}
+}
+
+void prp_latency_reset(void)
+{
+	int cpu;
+
+	for_each_possible_cpu(cpu)
+		memset(per_cpu_ptr(&prp_lat_hist, cpu), 0,
+		       sizeof(struct prp_lat_hist));
+}
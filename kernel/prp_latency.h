@@ -0,0 +1,77 @@
+#ifndef __PRP_LATENCY_H
+#define __PRP_LATENCY_H
+
+#include <linux/jump_label.h>
+#include <linux/percpu.h>
+#include <linux/timex.h>
+#include <linux/log2.h>
+
+/*
+ * Per-stage latency histograms of the RX and TX paths, in CPU cycles.
+ * Off by default; while off, each measuring point is a single patched-out
+ * jump. Enabled and read through debugfs, see prp_debugfs.c.
+ */
+
+enum prp_lat_stage {
+	PRP_LAT_RX_CLASSIFY,	/* RX handler: share check and prp_classify() */
+	PRP_LAT_RX_NODE_LOOKUP,	/* batch_get_node(), including adding */
+	PRP_LAT_RX_LOCK_WAIT,	/* taking the node's seq_lock */
+	PRP_LAT_RX_REGISTER,	/* register_frame() */
+	PRP_LAT_RX_SUP,		/* prp_handle_sup(), in the supervision work */
+	PRP_LAT_RX_DELIVER,	/* napi_gro_receive() of one frame */
+	PRP_LAT_TX_NODE_LOOKUP,	/* prp_get_node() for the destination */
+	PRP_LAT_TX_COPY,	/* pskb_copy() and adding the RCT */
+	PRP_LAT_TX_XMIT,	/* handing a batch, or a SAN frame, to a slave */
+
+	__PRP_LAT_MAX,
+};
+
+/* Bucket 0 counts 0 cycles, bucket i counts [2^(i-1), 2^i); the last one
+ * counts everything above. */
+#define PRP_LAT_BUCKETS		32
+
+struct prp_lat_hist {
+	u64	count[__PRP_LAT_MAX][PRP_LAT_BUCKETS];
+};
+
+DECLARE_STATIC_KEY_FALSE(prp_latency_enabled);
+DECLARE_PER_CPU(struct prp_lat_hist, prp_lat_hist);
+
+extern const char * const prp_lat_stage_names[__PRP_LAT_MAX];
+
+void prp_latency_enable(bool enable);
+void prp_latency_fold(struct prp_lat_hist *total);
+void prp_latency_reset(void);
+
+/* Start of a stage; 0 if disabled */
+static __always_inline u64 prp_lat_start(void)
+{
+	if (static_branch_unlikely(&prp_latency_enabled))
+		return get_cycles();
+	return 0;
+}
+
+/**
+ * prp_lat_end - Count the cycles since @start for @stage.
+ * 	Returns the current cycle count, so that the next stage can start
+ * 	from it. Ignored if the key was off when @start was taken.
+ */
+static __always_inline u64 prp_lat_end(enum prp_lat_stage stage, u64 start)
+{
+	u64 now, delta;
+	unsigned int b;
+
+	if (!static_branch_unlikely(&prp_latency_enabled))
+		return 0;
+	now = get_cycles();
+	if (unlikely(!start))
+		return now;
+
+	delta = now - start;
+	b = delta ? min_t(unsigned int, ilog2(delta) + 1, PRP_LAT_BUCKETS - 1)
+		  : 0;
+	this_cpu_inc(prp_lat_hist.count[stage][b]);
+	return now;
+}
+
+#endif /* __PRP_LATENCY_H */
@@ -1,16 +1,26 @@
 #include <linux/init.h>
 #include <linux/module.h>
 #include <linux/netdevice.h>
+#include <linux/log2.h>
 #include "prp_main.h"
 #include "prp_dev.h"
+#include "prp_tx.h"
 #include "prp_netlink.h"
+#include "prp_debugfs.h"
+#include "prp_sched.h"
 #include "debug.h"
 
+#define CREATE_TRACE_POINTS
+#include "prp_trace.h"
+
 /* PRP constants - set them up as module parameters allowing change */
 static unsigned int life_check_interval  = LIFE_CHECK_INTERVAL;
 static unsigned int node_forget_time 	  = NODE_FORGET_TIME;
-static unsigned int entry_forget_time	  = ENTRY_FORGET_TIME;
+unsigned int prp_entry_forget_time	  = ENTRY_FORGET_TIME;
 static unsigned int node_reboot_interval = NODE_REBOOT_INTERVAL;
+unsigned int prp_window_size		  = PRP_WINDOW_SIZE;
+bool prp_skew_hist			  = false;
+bool prp_tx_direct			  = true;
 
 module_param(life_check_interval, uint, S_IRUGO|S_IWUSR);
 MODULE_PARM_DESC(life_check_interval, "Interval between two successive"
@@ -18,12 +28,49 @@ MODULE_PARM_DESC(life_check_interval, "Interval between two successive"
 module_param(node_forget_time, uint, S_IRUGO|S_IWUSR);
 MODULE_PARM_DESC(node_forget_time, "Time to wait after the last frame"
 		"received from a node, before removing it from the node table");
-module_param(entry_forget_time, uint, S_IRUGO|S_IWUSR);
+module_param_named(entry_forget_time, prp_entry_forget_time, uint,
+		   S_IRUGO|S_IWUSR);
 MODULE_PARM_DESC(entry_forget_time, "Maximum time a frame with a sequence"
 		"number from a source is remembered for discarding");
 module_param(node_reboot_interval, uint, S_IRUGO|S_IWUSR);
 MODULE_PARM_DESC(node_reboot_interval, "Time to remain silent after rebooting");
 
+static int window_size_set(const char *val, const struct kernel_param *kp)
+{
+	unsigned int size;
+	int res;
+
+	res = kstrtouint(val, 0, &size);
+	if (res)
+		return res;
+	if (!is_power_of_2(size) || size < PRP_WINDOW_SIZE_MIN
+	    || size > PRP_WINDOW_SIZE_MAX)
+		return -EINVAL;
+	WRITE_ONCE(prp_window_size, size);
+	return 0;
+}
+
+static const struct kernel_param_ops window_size_ops = {
+	.set = window_size_set,
+	.get = param_get_uint,
+};
+
+module_param_cb(window_size, &window_size_ops, &prp_window_size,
+		S_IRUGO|S_IWUSR);
+MODULE_PARM_DESC(window_size, "Number of sequence numbers per node remembered"
+		" for duplicate discard; power of 2 between 8 and 32768."
+		" Applies to nodes added afterwards");
+
+module_param_named(skew_hist, prp_skew_hist, bool, S_IRUGO|S_IWUSR);
+MODULE_PARM_DESC(skew_hist, "Measure the time between the two copies of each"
+		" frame. Costs a clock read per frame and 4 bytes per window"
+		" entry; applies to nodes added afterwards");
+
+module_param_named(tx_direct, prp_tx_direct, bool, S_IRUGO|S_IWUSR);
+MODULE_PARM_DESC(tx_direct, "Hand bursts of frames straight to the slaves'"
+		" drivers with xmit_more on TX queues without a qdisc"
+		" (noqueue); queues with one always go through it");
+
 static int prp_netdev_notifier(struct notifier_block *nb, unsigned long event,
 			       void *ptr)
 {
@@ -43,9 +90,13 @@ static int prp_netdev_notifier(struct notifier_block *nb, unsigned long event,
 		break;
 	case NETDEV_CHANGEADDR:
 		PDEBUG("%s: change addr\n", dev->name);
+		/* The supervision frames carry our address */
+		if (prp_sup_rebuild(dev))
+			netdev_warn(dev, "failed to rebuild supervision frames\n");
 		break;
 	case NETDEV_CHANGENAME:
 		PDEBUG("%s: change name\n", dev->name);
+		prp_debugfs_rename_dev(dev);
 		break;
 	case NETDEV_CHANGEMTU:
 		/* assert (MTU <= min(MTU of slaves) - RCT length) */
@@ -70,6 +121,7 @@ static struct notifier_block prp_nb = {
 
 static int __init prp_module_init(void)
 {
+	prp_debugfs_init();
 	register_netdevice_notifier(&prp_nb);
 	prp_netlink_init();
 	printk(KERN_INFO "[PRP] Loading PRP\n");
@@ -81,6 +133,10 @@ static void __exit prp_module_exit(void)
 {
 	unregister_netdevice_notifier(&prp_nb);
 	prp_netlink_exit();
+	prp_sched_exit();
+	/* Wait for node table entries freed with call_rcu() */
+	rcu_barrier();
+	prp_debugfs_exit();
 	printk(KERN_INFO "[PRP] Unloading PRP\n");
 }
 
@@ -2,9 +2,15 @@
 #define PRP_MAIN_H
 
 #include <linux/if_ether.h>
+#include <linux/skbuff.h>
 #include <linux/spinlock.h>
+#include <linux/rhashtable-types.h>
+#include <linux/workqueue.h>
+#include "prp_genl.h"
 
-#define NODETABLE_SIZE	256
+/* The node table grows and shrinks with the number of nodes; never below
+ * this many buckets. */
+#define NODETABLE_MIN_SIZE	64
 
 #define PRP_RCTLEN	6
 #define PRP_SUFFIX	0x88fb
@@ -21,11 +27,25 @@
 #define NODE_FORGET_TIME	60000
 /* How often do we prune nodes older than NODE_FORGET_TIME */
 #define PRUNE_PERIOD		3000
+/* A DANP not heard on one LAN for this long has lost that LAN */
+#define PRP_LAN_LOST_TIME	(2 * LIFE_CHECK_INTERVAL)
 /* Maximum time a frame with a sequence number from a source is remembered
  * for discarding */
 #define ENTRY_FORGET_TIME	400
 /* A node that reboots remains silent for this period */
 #define NODE_REBOOT_INTERVAL	500
+/* Number of sequence numbers per node remembered for duplicate discard.
+ * Must be a power of 2, at most 2^15 so that "older" and "newer" are
+ * unambiguous within the 16-bit sequence number space. */
+#define PRP_WINDOW_SIZE		128
+#define PRP_WINDOW_SIZE_MIN	8
+#define PRP_WINDOW_SIZE_MAX	32768
+
+/* Module parameters, see prp_main.c */
+extern unsigned int prp_entry_forget_time;
+extern unsigned int prp_window_size;
+extern bool prp_skew_hist;
+extern bool prp_tx_direct;
 
 /**
  * PRP Redundancy Control Trailer (RCT) as specified in IEC 62439-3:2016 (p. 20)
@@ -45,6 +65,15 @@ struct prp_rct {
 	__be16	prp_suffix;
 } __packed ;
 
+/**
+ * struct prp_skew_hist - Time between the first and the second copy of
+ * 	frames from a node, see PRP_SKEW_BUCKETS.
+ * @count: Indexed by the LAN of the first copy (lan & 0x1).
+ */
+struct prp_skew_hist {
+	u32	count[2][PRP_SKEW_BUCKETS];
+};
+
 struct prp_port {
 	struct net_device	*dev;
 	struct net_device	*master;
@@ -53,29 +82,65 @@ struct prp_port {
 
 
 /**
- * struct win_timestamp - To store the timestamp for each frame in window.
- * 	We use linear search. Empty entry is marked by seqnr=-1.
- * 	There will NOT be any empty entry after the first PRP_WINDOW_SIZE
- * 	frames are received.
- * @time: jiffies at which the frame with given sequence number arrived.
- * @seqnr: Sequence number of frame. We use linear search.
+ * struct prp_window - Duplicate discard window of a node.
+ * 	One bit per sequence number, indexed by seqnr & (@size - 1), for the
+ * 	@size sequence numbers up to and including @top. See register_frame().
+ * @last_in: jiffies at which the last frame was registered.
+ * @top: Highest sequence number seen.
+ * @size: Number of sequence numbers remembered; a power of 2.
+ * @valid: False until the first frame, or after the window was forgotten.
+ * @lan_valid: Bit (lan & 0x1) set once @lan_top holds a sequence number.
+ * @lan_top: Highest sequence number seen on each LAN, for reordering.
+ * @block_time: jiffies at which a bit was last set in each word of @seen,
+ * 	see window_refresh(). Lives in the same allocation, after @seen.
+ * @stamp: Arrival time of the first copy for each bit of @seen, see
+ * 	prp_skew_stamp(). NULL unless skew_hist was set when the window was
+ * 	allocated; it then lives in the same allocation, after @block_time.
+ * @skew: Skew histogram of the node; with @stamp.
+ * @seen: Bitmap of sequence numbers seen, followed by one bitmap of the same
+ * 	size per LAN with the ones seen on that LAN; see window_lan_map().
  */
-struct window {
-	unsigned long	time;
-	int		seqnr;
+struct prp_window {
+	unsigned long	last_in;
+	u16		top;
+	u16		size;
+	bool		valid;
+	u8		lan_valid;
+	u16		lan_top[2];
+	unsigned long	*block_time;
+	u32		*stamp;
+	struct prp_skew_hist *skew;
+	unsigned long	seen[];
 };
 
 /**
- * Node table entry - Each entry is part of a linked list in a hash bucket.
+ * Node table entry - Each entry is part of the node table rhashtable, keyed by
+ * @mac. Lookups only need rcu_read_lock(); @mac never changes once the
+ * node is in the table, the other fields are updated in place.
+ *
+ * @seq_lock: Protects @window and the counters. Taken by RX for every PRP
+ * 	frame from this node, so it is per node instead of per table.
+ * @cnt_dup: Duplicates discarded.
+ * @cnt_lost_lan: Sequence numbers that left the window having been
+ * 	received on the other LAN only.
+ * @cnt_ooo: Frames received on a LAN after a higher sequence number had
+ * 	already arrived on the same LAN.
+ * @lan_lost: Bit (lan & 0x1) set while a DANP is only heard on the other
+ * 	LAN. Only used by the prune work.
  */
 struct node_entry {
-	struct hlist_node	list;
+	struct rhash_head	hash_node;
+	struct rcu_head		rcu_head;
 	/* remote node address */
 	unsigned char		mac[ETH_ALEN];
 	/* time the last frame arrived through the ports */
 	unsigned long		time_last_in[2];
-#define PRP_WINDOW_SIZE	32
-	struct window		*window;
+	spinlock_t		seq_lock;
+	struct prp_window	*window;
+	u64			cnt_dup;
+	u64			cnt_lost_lan[2];
+	u64			cnt_ooo[2];
+	u8			lan_lost;
 	bool			san_a;
 	bool			san_b;
 };
@@ -84,27 +149,51 @@ struct node_entry {
  * PRP net_device.priv structure
  * 
  * @ports:		Slave devices
- * @node_table:		Node table
+ * @node_table:		Node table, resized automatically by rhashtable
+ * @node_tbl_size:	Number of buckets last seen, to notice resizes
+ * @node_tbl_resizes:	Number of node table resizes seen
  * @sup_seqnr:		Sequence number for supervision frames
- * @seqnr:		Sequence number for other frames
+ * @seqnr:		Sequence number for other frames. Taken by the CPUs
+ * 			in blocks, see prp_next_seqnr(); on a cache line of
+ * 			its own so that this does not also bounce the
+ * 			read-mostly fields.
  * @sup_multicast_addr:	Multicast address to which supervision frames are sent
- * @dev_stats:		Device statistics
- * @sup_timer:		Timer for sending out supervision frames
- * @prune_timer:	Timer for removing stale node table entries
- * @node_tbl_root:	sysfs entry for displaying nodes table
+ * @pcpu_stats:		Per-CPU counters, see prp_stats.h
+ * @sched_list:		Entry in the list of devices, see prp_sched.c
+ * @sup_active:		Send supervision frames; set while operstate is UP
+ * @sup_lock:		Protects @sup_skb and @sup_spare
+ * @sup_skb:		Supervision frame for each LAN, RCT included; never
+ * 			sent itself
+ * @sup_spare:		Copy of @sup_skb to be sent next, see
+ * 			prp_send_supervision()
+ * @node_tbl_root:	debugfs directory of the device (node table stats)
+ * @rx_cells:		Per-CPU queues of received frames, see prp_rx_poll()
+ * @tx_batches:		Per-CPU frames waiting for the slaves, see prp_dev_xmit()
+ * @events:		Node table events waiting to be multicast
+ * @sup_queue:		Received supervision frames, see prp_sup_work()
+ * @sup_work:		Work processing @sup_queue
  */
 struct prp_priv {
 	struct prp_port			ports[2];
-	struct hlist_head		node_table[NODETABLE_SIZE];
-	rwlock_t			node_table_lock;
-	struct timer_list		sup_timer;
-	struct timer_list		prune_timer;
+	struct rhashtable		node_table;
+	unsigned int			node_tbl_size;
+	atomic_t			node_tbl_resizes;
+	struct list_head		sched_list;
+	bool				sup_active;
+	spinlock_t			sup_lock;
+	struct sk_buff			*sup_skb[2];
+	struct sk_buff			*sup_spare[2];
 	atomic_t			sup_seqnr;
-	atomic_t			seqnr;
 	unsigned char			sup_multicast_addr[ETH_ALEN] __aligned(sizeof(u16));
 					/* ether_addr_equal requires alignment to u16 */
-	struct rtnl_link_stats64	*stats;
+	struct prp_pcpu_stats __percpu	*pcpu_stats;
 	struct dentry			*node_tbl_root;
+	struct prp_rx_cell __percpu	*rx_cells;
+	struct prp_tx_batch __percpu	*tx_batches;
+	struct prp_event_queue		*events;
+	struct sk_buff_head		sup_queue;
+	struct work_struct		sup_work;
+	atomic_t			seqnr ____cacheline_aligned_in_smp;
 };
 
 
@@ -176,17 +265,33 @@ struct prp_sup_payload {
 } __packed;
 
 /**
- * RX, TX
+ * prp_sup_hdr - Supervision frame up to the TLV after TLV1, which is either
+ * 	TLV2 (RedBox MAC) or TLV0. Used for parsing on RX.
+ */
+struct prp_sup_hdr {
+	struct prp_sup_tag	sup_tag;
+	struct prp_sup_payload	payload;	/* MAC of DANP */
+	struct prp_sup_tlv	next;
+} __packed;
+
+/**
+ * RX
  *
  * Get PRP RCT from the tail of skb and return IF valid PRP suffix,
  * else return NULL.
+ * The skb may be nonlinear: if the RCT is in the linear area a pointer into
+ * the skb is returned, if it is (partly) in a page fragment it is copied
+ * into @buf, like skb_header_pointer() does.
  */
-static inline struct prp_rct *prp_get_rct(struct sk_buff *skb)
+static inline const struct prp_rct *prp_get_rct(const struct sk_buff *skb,
+						struct prp_rct *buf)
 {
-	unsigned char *tail = skb_tail_pointer(skb) - PRP_RCTLEN;
-	struct prp_rct *rct = (struct prp_rct *)tail;
+	const struct prp_rct *rct;
 
-	if (rct->prp_suffix == htons(ETH_P_PRP))
+	if (unlikely(skb->len < PRP_RCTLEN))
+		return NULL;
+	rct = skb_header_pointer(skb, skb->len - PRP_RCTLEN, PRP_RCTLEN, buf);
+	if (rct && rct->prp_suffix == htons(ETH_P_PRP))
 		return rct;
 	return NULL;
 }
@@ -194,13 +299,13 @@ static inline struct prp_rct *prp_get_rct(struct sk_buff *skb)
 /**
  * RX
  */
-static inline int prp_get_lsdu_size(struct prp_rct *rct)
+static inline int prp_get_lsdu_size(const struct prp_rct *rct)
 {
 	return ntohs(rct->lan_id_and_lsdu_size) & 0x0fff;
 
 }
 
-static inline int prp_get_lan_id(struct prp_rct *rct)
+static inline int prp_get_lan_id(const struct prp_rct *rct)
 {
 	return (ntohs(rct->lan_id_and_lsdu_size) & 0xf000) >> 12;
 
@@ -1,10 +1,16 @@
 #include <linux/kernel.h>
+#include <linux/rhashtable.h>
 #include <net/rtnetlink.h>
 #include <net/genetlink.h>
 #include "prp_main.h"
 #include "prp_link.h"
+#include "prp_genl.h"
 #include "prp_netlink.h"
 #include "prp_dev.h"
+#include "prp_node.h"
+#include "prp_event.h"
+#include "prp_debugfs.h"
+#include "prp_sched.h"
 #include "debug.h"
 
 static const struct nla_policy prp_policy[IFLA_PRP_MAX + 1] = {
@@ -60,21 +66,27 @@ static void prp_dellink(struct net_device *dev, struct list_head *head)
 {
 	struct prp_priv *priv = netdev_priv(dev);
 
-	/*
-	 * TODO:
-	 * 	delete timer for PRUNE
-	 */
+	/* The supervision work reads port->dev, which prp_del_port() clears */
+	prp_sched_del(priv);
+
 	prp_del_port(&priv->ports[0]);
 	prp_del_port(&priv->ports[1]);
 
-	del_timer_sync(&priv->sup_timer);
-	del_timer_sync(&priv->prune_timer);
-
-	prp_del_node_table(priv);
+	prp_debugfs_del_dev(dev);
 
+	/* The node table is freed by the device destructor */
 	unregister_netdevice_queue(dev, head);
 }
 
+/*
+ * The slaves are not known yet when the device is allocated; allocate a TX
+ * queue per CPU and use as many as the slaves have, see prp_set_tx_queues().
+ */
+static unsigned int prp_get_num_tx_queues(void)
+{
+	return num_possible_cpus();
+}
+
 static struct rtnl_link_ops prp_link_ops __read_mostly = {
 	.kind		= "prp",
 	/* Highest device specific netlink attribute number */
@@ -85,6 +97,7 @@ static struct rtnl_link_ops prp_link_ops __read_mostly = {
 	.priv_size	= sizeof(struct prp_priv),
 	/* net_device setup function */
 	.setup		= prp_dev_setup,
+	.get_num_tx_queues = prp_get_num_tx_queues,
 	/* Function for configuring and registering a new device */
 	.newlink	= prp_newlink,
 	.dellink	= prp_dellink,
@@ -92,24 +105,288 @@ static struct rtnl_link_ops prp_link_ops __read_mostly = {
 	.fill_info	= NULL,
 };
 
-// static struct genl_family prp_genl_family __ro_after_init = {
-// 	/* Let genl controller assign the channel when we register */
-// 	.id = GENL_ID_GENERATE,
-// 	.hdrsize = 0,		/* does not make use of family specific header */
-// 	.name = "PRP",		/* key the controller uses to lookup channel numbers */
-// 	.module = THIS_MODULE,
-// 	.netnsok = true,	/* can handle network namespaces */
-// };
+/*
+ * Generic netlink, see prp_genl.h
+ */
+static struct genl_family prp_genl_family;
+
+static const struct nla_policy prp_genl_policy[PRP_A_MAX + 1] = {
+	[PRP_A_IFINDEX]		= { .type = NLA_U32 },
+};
+
+/**
+ * prp_node_dump_start - Find the PRP device to dump the node table of and set
+ * 	up a walk of its node table that is kept across the dump callbacks.
+ * 	The device is held until the dump is done; the node table is only
+ * 	freed by its destructor, which waits for that.
+ */
+static int prp_node_dump_start(struct netlink_callback *cb)
+{
+	const struct genl_dumpit_info *info = genl_dumpit_info(cb);
+	struct rhashtable_iter *iter;
+	struct net_device *dev;
+	struct prp_priv *priv;
+
+	if (!info->attrs[PRP_A_IFINDEX]) {
+		NL_SET_ERR_MSG_MOD(cb->extack, "PRP device not specified");
+		return -EINVAL;
+	}
+
+	dev = dev_get_by_index(sock_net(cb->skb->sk),
+			       nla_get_u32(info->attrs[PRP_A_IFINDEX]));
+	if (!dev) {
+		NL_SET_ERR_MSG_MOD(cb->extack, "Device does not exist");
+		return -ENODEV;
+	}
+	if (!is_prp_master(dev)) {
+		NL_SET_ERR_MSG_MOD(cb->extack, "Not a PRP device");
+		dev_put(dev);
+		return -EINVAL;
+	}
+
+	iter = kmalloc(sizeof(*iter), GFP_KERNEL);
+	if (!iter) {
+		dev_put(dev);
+		return -ENOMEM;
+	}
+	priv = netdev_priv(dev);
+	rhashtable_walk_enter(&priv->node_table, iter);
+
+	cb->args[0] = (long)dev;
+	cb->args[1] = (long)iter;
+	return 0;
+}
+
+static int prp_node_dump_done(struct netlink_callback *cb)
+{
+	struct net_device *dev = (struct net_device *)cb->args[0];
+	struct rhashtable_iter *iter = (struct rhashtable_iter *)cb->args[1];
+
+	if (iter) {
+		rhashtable_walk_exit(iter);
+		kfree(iter);
+	}
+	dev_put(dev);
+	return 0;
+}
+
+/* Milliseconds since @then; RX may have updated it after we read @now */
+static inline u32 prp_msecs_since(unsigned long now, unsigned long then)
+{
+	return time_after(now, then) ? jiffies_to_msecs(now - then) : 0;
+}
+
+static int prp_fill_node(struct sk_buff *skb, struct netlink_callback *cb,
+			 struct net_device *dev, struct node_entry *node,
+			 unsigned long now)
+{
+	struct prp_node_info info;
+	void *hdr;
+
+	prp_node_get_info(node, &info);
+
+	hdr = genlmsg_put(skb, NETLINK_CB(cb->skb).portid, cb->nlh->nlmsg_seq,
+			  &prp_genl_family, NLM_F_MULTI, PRP_C_GET_NODE_LIST);
+	if (!hdr)
+		return -EMSGSIZE;
+
+	if (nla_put_u32(skb, PRP_A_IFINDEX, dev->ifindex) ||
+	    nla_put(skb, PRP_A_NODE_MAC, ETH_ALEN, info.mac) ||
+	    nla_put_u8(skb, PRP_A_NODE_STATE,
+		       prp_node_state(info.san_a, info.san_b)) ||
+	    nla_put_u32(skb, PRP_A_NODE_LAST_SEEN_A,
+			prp_msecs_since(now, info.time_last_in[0])) ||
+	    nla_put_u32(skb, PRP_A_NODE_LAST_SEEN_B,
+			prp_msecs_since(now, info.time_last_in[1])) ||
+	    nla_put_u64_64bit(skb, PRP_A_NODE_DUPLICATES, info.duplicates,
+			      PRP_A_PAD) ||
+	    nla_put_u64_64bit(skb, PRP_A_NODE_LOST_A, info.lost_lan[0],
+			      PRP_A_PAD) ||
+	    nla_put_u64_64bit(skb, PRP_A_NODE_LOST_B, info.lost_lan[1],
+			      PRP_A_PAD) ||
+	    nla_put_u64_64bit(skb, PRP_A_NODE_OUT_OF_ORDER_A,
+			      info.out_of_order[0], PRP_A_PAD) ||
+	    nla_put_u64_64bit(skb, PRP_A_NODE_OUT_OF_ORDER_B,
+			      info.out_of_order[1], PRP_A_PAD) ||
+	    nla_put_u32(skb, PRP_A_NODE_WINDOW_SIZE, info.window_size) ||
+	    nla_put_u32(skb, PRP_A_NODE_WINDOW_SEEN, info.window_seen))
+		goto nla_put_failure;
+	if (info.has_skew &&
+	    (nla_put(skb, PRP_A_NODE_SKEW_A_FIRST, sizeof(info.skew.count[0]),
+		     info.skew.count[0]) ||
+	     nla_put(skb, PRP_A_NODE_SKEW_B_FIRST, sizeof(info.skew.count[1]),
+		     info.skew.count[1])))
+		goto nla_put_failure;
+
+	genlmsg_end(skb, hdr);
+	return 0;
+
+nla_put_failure:
+	genlmsg_cancel(skb, hdr);
+	return -EMSGSIZE;
+}
+
+/**
+ * prp_node_dump - Fill one skb with node table entries, continuing the walk
+ * 	where the last call stopped.
+ * 	The RCU read lock is only held while filling this skb, and each node's
+ * 	seq_lock only for a few reads, so RX is not held up even by large
+ * 	tables. If the table is resized during the dump, the walk restarts
+ * 	and some nodes may be reported twice.
+ */
+static int prp_node_dump(struct sk_buff *skb, struct netlink_callback *cb)
+{
+	struct net_device *dev = (struct net_device *)cb->args[0];
+	struct rhashtable_iter *iter = (struct rhashtable_iter *)cb->args[1];
+	unsigned long now = jiffies;
+	struct node_entry *node;
+	int res = 0;
+
+	rhashtable_walk_start(iter);
+	/* Starts with the node that did not fit into the last skb */
+	for (node = rhashtable_walk_peek(iter); node;
+	     node = rhashtable_walk_next(iter)) {
+		if (IS_ERR(node)) {
+			if (PTR_ERR(node) == -EAGAIN)
+				continue;
+			res = PTR_ERR(node);
+			break;
+		}
+		if (prp_fill_node(skb, cb, dev, node, now))
+			break;
+	}
+	rhashtable_walk_stop(iter);
+
+	return res ? res : skb->len;
+}
+
+static int prp_put_event(struct sk_buff *skb, const struct prp_event *ev)
+{
+	struct nlattr *nest;
+
+	nest = nla_nest_start(skb, PRP_A_EVENT);
+	if (!nest)
+		return -EMSGSIZE;
+	if (nla_put_u8(skb, PRP_A_EVENT_TYPE, ev->type))
+		goto nla_put_failure;
+
+	switch (ev->type) {
+	case PRP_EVENT_NODE_ADD:
+	case PRP_EVENT_NODE_STATE:
+		if (nla_put(skb, PRP_A_NODE_MAC, ETH_ALEN, ev->mac) ||
+		    nla_put_u8(skb, PRP_A_NODE_STATE, ev->state))
+			goto nla_put_failure;
+		break;
+	case PRP_EVENT_LAN_LOST:
+	case PRP_EVENT_LAN_RESTORED:
+		if (nla_put(skb, PRP_A_NODE_MAC, ETH_ALEN, ev->mac) ||
+		    nla_put_u8(skb, PRP_A_EVENT_LAN, ev->lan))
+			goto nla_put_failure;
+		break;
+	case PRP_EVENT_NODE_DEL:
+		if (nla_put(skb, PRP_A_NODE_MAC, ETH_ALEN, ev->mac))
+			goto nla_put_failure;
+		break;
+	}
+
+	nla_nest_end(skb, nest);
+	return 0;
+
+nla_put_failure:
+	nla_nest_cancel(skb, nest);
+	return -EMSGSIZE;
+}
+
+/* Only queue events if someone is listening in the device's netns */
+bool prp_genl_has_listeners(struct net_device *dev)
+{
+	return genl_has_listeners(&prp_genl_family, dev_net(dev),
+				  PRP_MCGRP_EVENTS);
+}
+
+/**
+ * prp_genl_send_events - Send @n events of @dev as one PRP_C_NODE_EVENT
+ * 	message to the events group. @n is small enough for NLMSG_GOODSIZE,
+ * 	see PRP_EVENT_BATCH. Called from process context.
+ * @overflow: Events were dropped before these; send PRP_EVENT_OVERFLOW first.
+ */
+void prp_genl_send_events(struct net_device *dev, const struct prp_event *ev,
+			  unsigned int n, bool overflow)
+{
+	struct prp_event ovf = { .type = PRP_EVENT_OVERFLOW };
+	struct sk_buff *skb;
+	void *hdr;
+
+	skb = genlmsg_new(NLMSG_GOODSIZE, GFP_KERNEL);
+	if (!skb)
+		return;
+
+	hdr = genlmsg_put(skb, 0, 0, &prp_genl_family, 0, PRP_C_NODE_EVENT);
+	if (!hdr)
+		goto nla_put_failure;
+
+	if (nla_put_u32(skb, PRP_A_IFINDEX, dev->ifindex))
+		goto nla_put_failure;
+	if (overflow && prp_put_event(skb, &ovf))
+		goto nla_put_failure;
+	for (unsigned int i = 0; i < n; i++)
+		if (prp_put_event(skb, &ev[i]))
+			goto nla_put_failure;
+
+	genlmsg_end(skb, hdr);
+	genlmsg_multicast_netns(&prp_genl_family, dev_net(dev), skb, 0,
+				PRP_MCGRP_EVENTS, GFP_KERNEL);
+	return;
+
+nla_put_failure:
+	nlmsg_free(skb);
+}
+
+static const struct genl_multicast_group prp_genl_mcgrps[] = {
+	[PRP_MCGRP_EVENTS] = { .name = PRP_GENL_MCGRP_EVENTS, },
+};
+
+static const struct genl_ops prp_genl_ops[] = {
+	{
+		.cmd	= PRP_C_GET_NODE_LIST,
+		.start	= prp_node_dump_start,
+		.dumpit	= prp_node_dump,
+		.done	= prp_node_dump_done,
+	},
+};
+
+static struct genl_family prp_genl_family __ro_after_init = {
+	.hdrsize	= 0,		/* does not make use of family specific header */
+	.name		= PRP_GENL_NAME,	/* key the controller uses to lookup channel numbers */
+	.version	= PRP_GENL_VERSION,
+	.maxattr	= PRP_A_MAX,
+	.policy		= prp_genl_policy,
+	.module		= THIS_MODULE,
+	.netnsok	= true,		/* can handle network namespaces */
+	.ops		= prp_genl_ops,
+	.n_ops		= ARRAY_SIZE(prp_genl_ops),
+	.mcgrps		= prp_genl_mcgrps,
+	.n_mcgrps	= ARRAY_SIZE(prp_genl_mcgrps),
+	.resv_start_op	= PRP_C_GET_NODE_LIST + 1,
+};
 
 int __init prp_netlink_init(void)
 {
 	int ret;
 
 	ret = rtnl_link_register(&prp_link_ops);
+	if (ret)
+		return ret;
+
+	ret = genl_register_family(&prp_genl_family);
+	if (ret)
+		rtnl_link_unregister(&prp_link_ops);
 	return ret;
 }
 
 void __exit prp_netlink_exit(void)
 {
+	/* Deletes the devices, which flush their events to the family */
 	rtnl_link_unregister(&prp_link_ops);
+	genl_unregister_family(&prp_genl_family);
 }
@@ -1,7 +1,20 @@
 #ifndef __PRP_NETLINK_H
 #define __PRP_NETLINK_H
 
+#include <linux/netdevice.h>
+
+struct prp_event;
+
+/* Index into prp_genl_mcgrps */
+enum {
+	PRP_MCGRP_EVENTS,
+};
+
 int __init prp_netlink_init(void);
 void __exit prp_netlink_exit(void);
 
+bool prp_genl_has_listeners(struct net_device *dev);
+void prp_genl_send_events(struct net_device *dev, const struct prp_event *ev,
+			  unsigned int n, bool overflow);
+
 #endif /* __PRP_NETLINK_H */
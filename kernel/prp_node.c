@@ -1,14 +1,44 @@
 #include <linux/etherdevice.h>
-#include <linux/hashtable.h>
+#include <linux/bitmap.h>
+#include <linux/rhashtable.h>
 #include <linux/xxhash.h>
 #include "prp_main.h"
 #include "prp_dev.h"
 #include "prp_node.h"
+#include "prp_event.h"
+#include "prp_trace.h"
 #include "debug.h"
 
-inline void prp_init_node_table(struct prp_priv *priv)
+/**
+ * prp_node_hashfn - Hash a MAC address for the node table.
+ * 	@seed is the random hash_rnd of the bucket table, which rhashtable picks
+ * 	per table and changes on every resize, so crafted source addresses
+ * 	cannot be aimed at a single bucket.
+ */
+static u32 prp_node_hashfn(const void *data, u32 len, u32 seed)
+{
+	return xxhash(data, ETH_ALEN, seed);
+}
+
+static const struct rhashtable_params prp_node_params = {
+	.head_offset		= offsetof(struct node_entry, hash_node),
+	.key_offset		= offsetof(struct node_entry, mac),
+	.key_len		= ETH_ALEN,
+	.hashfn			= prp_node_hashfn,
+	.min_size		= NODETABLE_MIN_SIZE,
+	.automatic_shrinking	= true,
+};
+
+int prp_init_node_table(struct prp_priv *priv)
 {
-	hash_init(priv->node_table);
+	int res;
+
+	res = rhashtable_init(&priv->node_table, &prp_node_params);
+	if (res)
+		return res;
+	priv->node_tbl_size = NODETABLE_MIN_SIZE;
+	atomic_set(&priv->node_tbl_resizes, 0);
+	return 0;
 }
 
 static void free_node(struct node_entry *node)
@@ -17,140 +47,294 @@ static void free_node(struct node_entry *node)
 	kfree(node);
 }
 
+static void free_node_rcu(struct rcu_head *head)
+{
+	free_node(container_of(head, struct node_entry, rcu_head));
+}
+
+static void free_node_cb(void *ptr, void *arg)
+{
+	free_node(ptr);
+}
+
 /**
- * free_bucket - Clears a hash bucket. Called holding @node_table_lock.
- * 	Deletes the nodes in the bucket and frees them.
- * @bucket: Hash bucket to clear
+ * prp_node_table_size - Number of buckets in the current bucket table.
+ * 	Caller must be holding the RCU read lock.
  */
-static inline void free_bucket(struct hlist_head *bucket)
+static unsigned int prp_node_table_size(struct prp_priv *priv)
 {
-	struct node_entry *node;
-	struct hlist_node *tmp;
+	struct bucket_table *tbl;
 
-	hlist_for_each_entry_safe(node, tmp, bucket, list) {
-		hlist_del(&node->list);
-		free_node(node);
-	}
+	tbl = rht_dereference_rcu(priv->node_table.tbl, &priv->node_table);
+	return tbl->size;
 }
 
 /**
- * prp_del_node_table - Delete the node table when the device is deleted.
- * @priv: Private data area of the device
+ * prp_check_resize - Count a resize of the node table if the bucket table
+ * 	changed size since we last looked. rhashtable resizes from a worker
+ * 	and has no callback, so this is called after every insert and remove,
+ * 	which are the only things that trigger a resize.
+ * 	Caller must be holding the RCU read lock.
  */
-void prp_del_node_table(struct prp_priv *priv)
+static void prp_check_resize(struct prp_priv *priv)
 {
-	write_lock(&priv->node_table_lock);
-	for (int i = 0; i < HASH_SIZE(priv->node_table); ++i)
-		free_bucket(&priv->node_table[i]);
-	write_unlock(&priv->node_table_lock);
+	unsigned int size = prp_node_table_size(priv);
+	unsigned int old = READ_ONCE(priv->node_tbl_size);
+
+	if (likely(size == old))
+		return;
+	if (cmpxchg(&priv->node_tbl_size, old, size) == old) {
+		atomic_inc(&priv->node_tbl_resizes);
+		PDEBUG("%s: node table resized %u -> %u buckets\n", __func__,
+			old, size);
+	}
 }
 
 /**
- * hash_mac - Compute the index of @mac for a hash table of size @nbuckets.
- *
- * @mac: MAC address
- * @nbuckets: Number of buckets, i.e, size of the hash table.
+ * del_node - Remove @node from the node table and free it once the RCU
+ * 	readers are done with it.
  */
-static unsigned int hash_mac(unsigned char mac[ETH_ALEN], unsigned int nbuckets)
+static inline void del_node(struct node_entry *node, struct prp_priv *priv)
 {
-	uint64_t seed = 0x533d15deadbeef11;
-	unsigned long index = xxhash(mac, ETH_ALEN, seed);
+	if (rhashtable_remove_fast(&priv->node_table, &node->hash_node,
+				   prp_node_params))
+		return;		/* someone else removed it */
+	call_rcu(&node->rcu_head, free_node_rcu);
+}
 
-	return index % nbuckets;
+/**
+ * prp_del_node_table - Delete the node table when the device is freed.
+ * 	Called from the device destructor, so there are no readers left.
+ * @priv: Private data area of the device
+ */
+void prp_del_node_table(struct prp_priv *priv)
+{
+	rhashtable_free_and_destroy(&priv->node_table, free_node_cb, NULL);
 }
 
 /**
  * prp_add_node - Allocate and add a new node with @mac to the node table.
  *	Returns the newly allocated node on success. The fields must be set
- *	by the caller. Does NOT check if @mac exists in the node table.
- *	Maybe set time_last_in too; would need LAN_ID.
+ *	by the caller. If another CPU added @mac after the caller's lookup
+ *	failed, that entry is returned instead and nothing is allocated.
  *
- *	! Caller must hold the write lock
+ *	Caller must be holding the RCU read lock.
  *
  * @mac: MAC address to add to the node table.
  * @priv: PRP priv.
  */
 struct node_entry *prp_add_node(unsigned char *mac, struct prp_priv *priv)
 {
-	struct node_entry *newnode;
-	unsigned int key;
+	struct node_entry *newnode, *node;
 
-	newnode = kmalloc(sizeof(*newnode), GFP_ATOMIC);
+	newnode = kzalloc(sizeof(*newnode), GFP_ATOMIC);
 	if (!newnode)
 		return NULL;
 
 	ether_addr_copy(newnode->mac, mac);
+	spin_lock_init(&newnode->seq_lock);
 	/* window is only needed for DANP, we do not know yet */
-	newnode->window = alloc_window(PRP_WINDOW_SIZE);	
-	init_window(newnode->window);
+	newnode->window = alloc_window(READ_ONCE(prp_window_size),
+				       READ_ONCE(prp_skew_hist), GFP_ATOMIC);
 	/* Set both san_a and san_b to true.
 	 * So the user can check if node is newly added or not. */
 	newnode->san_a = newnode->san_b = true;
+	newnode->time_last_in[0] = newnode->time_last_in[1] = jiffies;
 
-	key = hash_mac(mac, HASH_SIZE(priv->node_table));
-
-	/* Add node to list here */
-	hlist_add_head(&newnode->list, &(priv->node_table[key]));
+	/* Both ports may see the first frame from @mac at the same time */
+	node = rhashtable_lookup_get_insert_fast(&priv->node_table,
+						 &newnode->hash_node,
+						 prp_node_params);
+	if (node) {
+		free_node(newnode);
+		return IS_ERR(node) ? NULL : node;
+	}
+	prp_check_resize(priv);
+	trace_prp_node_add(priv->ports[0].master, mac);
+	prp_queue_event(priv, PRP_EVENT_NODE_ADD, mac, PRP_NODE_NEW, 0);
 
 	return newnode;
 }
 
 /**
  * prp_get_node - Get entry from node table for given mac address.
- * 	If the node entry does not exist, prp_add_node() is called, and the new
- * 	node is returned.
+ * 	Returns NULL if there is no entry for @mac; see prp_add_node().
  * 	Caller must be holding the RCU read lock
  *
  * @mac: MAC address of remote node.
  * @priv: PRP priv.
- * @lan: LAN through which the frame was received.
- * 	Used only if new node is being allocated. prp_add_node uses it to set
- * 	the time_last_in[lan] as early as possible.
  */
 struct node_entry *prp_get_node(unsigned char *mac, struct prp_priv *priv)
 {
-	struct node_entry *node;
-	unsigned key = hash_mac(mac, HASH_SIZE(priv->node_table));
+	return rhashtable_lookup(&priv->node_table, mac, prp_node_params);
+}
+
+/**
+ * prp_node_table_stats - Fill @stats with the current bucket occupancy of the
+ * 	node table. Walks every bucket under RCU; entries that a concurrent
+ * 	resize has already moved to the new table are not counted.
+ */
+void prp_node_table_stats(struct prp_priv *priv,
+			  struct prp_node_table_stats *stats)
+{
+	struct bucket_table *tbl;
+	struct rhash_head *pos;
+	unsigned int len;
+
+	memset(stats, 0, sizeof(*stats));
+
+	rcu_read_lock();
+	prp_check_resize(priv);
+	tbl = rht_dereference_rcu(priv->node_table.tbl, &priv->node_table);
+	stats->buckets = tbl->size;
+	for (unsigned int i = 0; i < tbl->size; i++) {
+		len = 0;
+		rht_for_each_rcu(pos, tbl, i)
+			len++;
+		stats->max_chain = max(stats->max_chain, len);
+		stats->chain_hist[min_t(unsigned int, len,
+					PRP_CHAIN_HIST_SIZE - 1)]++;
+	}
+	rcu_read_unlock();
+
+	stats->nodes = atomic_read(&priv->node_table.nelems);
+	stats->resizes = atomic_read(&priv->node_tbl_resizes);
+}
+
+/**
+ * prp_node_get_info - Take a snapshot of @node for reporting.
+ * 	Holds @node->seq_lock only for a few reads. Caller must be holding
+ * 	the RCU read lock and be in process context.
+ */
+void prp_node_get_info(struct node_entry *node, struct prp_node_info *info)
+{
+	struct prp_window *win;
+
+	ether_addr_copy(info->mac, node->mac);
+	info->san_a = READ_ONCE(node->san_a);
+	info->san_b = READ_ONCE(node->san_b);
+	info->time_last_in[0] = READ_ONCE(node->time_last_in[0]);
+	info->time_last_in[1] = READ_ONCE(node->time_last_in[1]);
+
+	/* RX takes seq_lock in softirq */
+	spin_lock_bh(&node->seq_lock);
+	info->duplicates = node->cnt_dup;
+	for (int i = 0; i < 2; i++) {
+		info->lost_lan[i] = node->cnt_lost_lan[i];
+		info->out_of_order[i] = node->cnt_ooo[i];
+	}
+	win = node->window;
+	info->window_size = win ? win->size : 0;
+	info->window_seen = win && win->valid ?
+			    bitmap_weight(win->seen, win->size) : 0;
+	info->has_skew = win && win->skew;
+	if (info->has_skew)
+		info->skew = *win->skew;
+	spin_unlock_bh(&node->seq_lock);
+}
+
+#ifdef PRP_DEBUG
+static void prp_dump_node_table(struct prp_priv *priv)
+{
+	struct rhashtable_iter iter;
+	struct node_entry *curr;
+
+	rhashtable_walk_enter(&priv->node_table, &iter);
+	rhashtable_walk_start(&iter);
+	while ((curr = rhashtable_walk_next(&iter))) {
+		unsigned char *mac;
+
+		if (IS_ERR(curr))
+			continue;
+		mac = curr->mac;
+		pr_info("%s: %02x:%02x:%02x:%02x:%02x:%02x"
+			"san_a=%d, san_b=%d\n", __func__,
+			mac[0], mac[1], mac[2], mac[3], mac[4], mac[5],
+			curr->san_a, curr->san_b);
+	}
+	rhashtable_walk_stop(&iter);
+	rhashtable_walk_exit(&iter);
+}
+#endif
+
+/**
+ * prp_check_lans - Report a DANP that is only heard on one LAN, and when it
+ * 	is heard on both again. A DANP sends supervision frames on both LANs
+ * 	every LIFE_CHECK_INTERVAL, so missing two of them on one LAN while the
+ * 	other is fine means that LAN is broken between us and the node.
+ * 	Only called from the prune work, so @node->lan_lost needs no lock.
+ */
+static void prp_check_lans(struct node_entry *node, struct prp_priv *priv,
+			   unsigned long time_a, unsigned long time_b,
+			   unsigned long now)
+{
+	unsigned long timeout = msecs_to_jiffies(PRP_LAN_LOST_TIME);
+	bool heard[2];
+
+	if (READ_ONCE(node->san_a) || READ_ONCE(node->san_b))
+		return;
+
+	heard[0] = time_before(now, time_a + timeout);
+	heard[1] = time_before(now, time_b + timeout);
+	/* Silent on both: the node is gone, it will be pruned */
+	if (!heard[0] && !heard[1])
+		return;
+
+	for (int i = 0; i < 2; i++) {
+		bool lost = node->lan_lost & BIT(i);
 
-	hlist_for_each_entry(node, &priv->node_table[key], list) {
-		if (ether_addr_equal(node->mac, mac))
-			return node;
+		if (!heard[i] && !lost) {
+			node->lan_lost |= BIT(i);
+			prp_queue_event(priv, PRP_EVENT_LAN_LOST, node->mac, 0,
+					i ? 0xB : 0xA);
+		} else if (heard[i] && lost) {
+			node->lan_lost &= ~BIT(i);
+			prp_queue_event(priv, PRP_EVENT_LAN_RESTORED, node->mac,
+					0, i ? 0xB : 0xA);
+		}
 	}
-	return NULL;
 }
 
 /**
  * prp_prune_nodes - Remove stale node table entries; ones we have not heard
- * from for HSR_LIFE_CHECK_INTERVAL milliseconds (2 seconds).
+ * from for NODE_FORGET_TIME milliseconds (60 seconds).
+ * Runs from a workqueue since rhashtable walks cannot be done in softirq;
+ * every PRUNE_PERIOD, for all devices at once, see prp_sched.c.
  */
-void prp_prune_nodes(struct timer_list *t)
+void prp_prune_nodes(struct prp_priv *priv)
 {
-	struct prp_priv *priv = from_timer(priv, t, prune_timer);
-	struct hlist_node *tmp;
+	struct rhashtable_iter iter;
 	struct node_entry *node;
 	unsigned long time_a, time_b, time;
 	unsigned long now = jiffies;
 
-	write_lock_bh(&priv->node_table_lock);
-	for (int i = 0; i < NODETABLE_SIZE; i++) {
-		hlist_for_each_entry_safe(node, tmp, &priv->node_table[i],
-					  list) {
-			time_a = node->time_last_in[0];
-			time_b = node->time_last_in[1];
-			/* calculate time when the entry becomes stale */
-			time = max(time_a, time_b) + msecs_to_jiffies(NODE_FORGET_TIME);
-			/* is that time before now? */
-			if (time_before(time, now)) {
-				pr_info("pruned node with mac="
-					"%02x:%02x:%02x:%02x:%02x:%02x\n",
-					node->mac[0], node->mac[1], node->mac[2],
-					node->mac[3], node->mac[4], node->mac[5]);
-				hlist_del(&node->list);
-				free_node(node);
-			}
+#ifdef PRP_DEBUG
+	prp_dump_node_table(priv);
+#endif
+
+	rhashtable_walk_enter(&priv->node_table, &iter);
+	rhashtable_walk_start(&iter);
+	while ((node = rhashtable_walk_next(&iter))) {
+		/* -EAGAIN: table was resized, the walk continues from the
+		 * start of the new table; we may see some nodes twice. */
+		if (IS_ERR(node))
+			continue;
+
+		time_a = READ_ONCE(node->time_last_in[0]);
+		time_b = READ_ONCE(node->time_last_in[1]);
+		/* calculate time when the entry becomes stale */
+		time = max(time_a, time_b) + msecs_to_jiffies(NODE_FORGET_TIME);
+		/* is that time before now? */
+		if (time_before(time, now)) {
+			trace_prp_node_prune(priv->ports[0].master, node->mac,
+					     jiffies_to_msecs(now - max(time_a, time_b)));
+			prp_queue_event(priv, PRP_EVENT_NODE_DEL, node->mac, 0, 0);
+			del_node(node, priv);
+			continue;
 		}
+		prp_check_lans(node, priv, time_a, time_b, now);
 	}
-	write_unlock_bh(&priv->node_table_lock);
-
-	mod_timer(&priv->prune_timer, jiffies + msecs_to_jiffies(PRUNE_PERIOD));
+	prp_check_resize(priv);
+	rhashtable_walk_stop(&iter);
+	rhashtable_walk_exit(&iter);
 }
@@ -1,33 +1,102 @@
 #ifndef __PRP_NODE
 #define __PRP_NODE
 
+#include <linux/slab.h>
 #include "prp_main.h"
+#include "prp_genl.h"
 
-void prp_init_node_table(struct prp_priv *priv);
+int prp_init_node_table(struct prp_priv *priv);
 
 void prp_del_node_table(struct prp_priv *priv);
 
-void prp_prune_nodes(struct timer_list *t);
+void prp_prune_nodes(struct prp_priv *priv);
 
 struct node_entry *prp_add_node(unsigned char *mac, struct prp_priv *priv);
 
 struct node_entry *prp_get_node(unsigned char *mac, struct prp_priv *priv);
 
-static inline struct window *alloc_window(int winsize)
+#define PRP_CHAIN_HIST_SIZE	8
+
+/**
+ * struct prp_node_table_stats - Node table occupancy, see debugfs.
+ * @chain_hist: Number of buckets with a chain of length i; the last entry
+ * 	counts all chains that are at least that long.
+ */
+struct prp_node_table_stats {
+	unsigned int	nodes;
+	unsigned int	buckets;
+	unsigned int	resizes;
+	unsigned int	max_chain;
+	unsigned int	chain_hist[PRP_CHAIN_HIST_SIZE];
+};
+
+void prp_node_table_stats(struct prp_priv *priv,
+			  struct prp_node_table_stats *stats);
+
+/* Snapshot of a node table entry, see prp_node_get_info() */
+struct prp_node_info {
+	unsigned char	mac[ETH_ALEN];
+	bool		san_a;
+	bool		san_b;
+	unsigned long	time_last_in[2];
+	u64		duplicates;
+	u64		lost_lan[2];
+	u64		out_of_order[2];
+	u32		window_size;
+	u32		window_seen;
+	bool		has_skew;
+	struct prp_skew_hist skew;
+};
+
+void prp_node_get_info(struct node_entry *node, struct prp_node_info *info);
+
+/* PRP_NODE_* for the given SAN flags; both true => new entry */
+static inline u8 prp_node_state(bool san_a, bool san_b)
+{
+	if (san_a && san_b)
+		return PRP_NODE_NEW;
+	if (san_a)
+		return PRP_NODE_SAN_A;
+	if (san_b)
+		return PRP_NODE_SAN_B;
+	return PRP_NODE_DANP;
+}
+
+/* Bitmap of the sequence numbers in @win seen on LAN (@lan & 0x1) */
+static inline unsigned long *window_lan_map(struct prp_window *win,
+					    unsigned int lan)
 {
-	return kmalloc(sizeof(struct window) * winsize, GFP_ATOMIC);
+	return &win->seen[BITS_TO_LONGS(win->size) * (1 + (lan & 0x1))];
 }
 
 /**
- * init_window - Initialise the drop window.
- *		 Set .seqnr = -1 for all.
- * @win: Window
+ * alloc_window - Allocate and initialise a drop window for @winsize sequence
+ * 	numbers. @winsize must be a power of 2, see prp_window_size.
+ * 	The per-LAN bitmaps and the block times follow the seen bitmap. With
+ * 	@skew, room for the arrival times and the skew histogram is allocated
+ * 	after them.
  */
-static void init_window(struct window *win)
+static inline struct prp_window *alloc_window(unsigned int winsize, bool skew,
+					      gfp_t gfp)
 {
-	/* use memset(0xff)? */
-	for (int i = 0; i < PRP_WINDOW_SIZE; i++)
-		win[i].seqnr = -1;
+	unsigned int longs = BITS_TO_LONGS(winsize);
+	struct prp_window *win;
+	size_t size;
+
+	size = struct_size(win, seen, 4 * longs);
+	if (skew)
+		size += winsize * sizeof(u32) + sizeof(struct prp_skew_hist);
+
+	win = kzalloc(size, gfp);
+	if (!win)
+		return NULL;
+	win->size = winsize;
+	win->block_time = &win->seen[3 * longs];
+	if (skew) {
+		win->stamp = (u32 *)&win->block_time[longs];
+		win->skew = (struct prp_skew_hist *)&win->stamp[winsize];
+	}
+	return win;
 }
 
 #endif /* __PRP_NODE */
@@ -1,26 +1,18 @@
 #include <linux/netdevice.h>
 #include <linux/etherdevice.h>
+#include <linux/bitmap.h>
+#include <linux/if_vlan.h>
 #include <asm/current.h>
 #include "prp_main.h"
 #include "prp_dev.h"
 #include "prp_rx.h"
 #include "prp_node.h"
+#include "prp_stats.h"
+#include "prp_event.h"
+#include "prp_trace.h"
+#include "prp_latency.h"
 #include "debug.h"
 
-/**
- * Check if LSDU size in RCT from received frame is correct, i.e,
- * is equal to the Ethernet payload size.
- */
-static inline bool prp_check_lsdu_size(struct sk_buff *skb, struct prp_rct *rct)
-{
-	struct ethhdr *ethhdr;
-	int expected_lsdu_size;
-
-	ethhdr = (struct ethhdr *)skb_mac_header(skb);
-	expected_lsdu_size = skb->len - 14;
-	return expected_lsdu_size == prp_get_lsdu_size(rct);
-}
-
 /**
  * get_rx_handler_data - Get RCU protected rx_handler_data from slave.
  * 	Checks is rx_handler for slave is our PRP rx handler (is this necessary?), and
@@ -35,303 +27,828 @@ static inline struct prp_port *get_rx_handler_data(struct net_device *dev)
 }
 
 /**
- * valid_rct - Return true if skb has a valid PRP RCT
+ * prp_classify_sup - Parse the supervision TLVs of a frame whose RCT was
+ * 	already found valid, and mark it PRP_FRAME_SUP if they are well formed.
+ * @offset: Offset of the supervision payload from skb->data, i.e, past any
+ * 	VLAN tag that was not stripped by the hardware.
  */
-bool valid_rct(struct sk_buff *skb, struct prp_port *port)
+static void prp_classify_sup(struct sk_buff *skb, unsigned int offset,
+			     struct prp_rx_cb *cb)
 {
-	struct prp_rct *rct;
-
-	rct = prp_get_rct(skb);
-	/* NULL if PRP suffix not valid, i.e, 0x88FB */
-	if (!rct)
-		return false;
+	const struct prp_sup_hdr *sup;
+	const struct prp_sup_tlv *tlv;
+	struct prp_sup_hdr sup_buf;
+	struct prp_sup_tlv tlv_buf;
+
+	/* tag - path, version, and sup_seqnr; TLV1; TLV1 payload; next TLV */
+	sup = skb_header_pointer(skb, offset, sizeof(*sup), &sup_buf);
+	if (!sup)
+		return;
 
-	/* TODO: need to increment error counter: CntErrWrongLanX */
-	if (port->lan != prp_get_lan_id(rct))
-		return false;
+	/* Verify initial TLV1 type */
+	if (sup->sup_tag.tlv.type != PRP_TLV_DUPACCEPT
+	    && sup->sup_tag.tlv.type != PRP_TLV_DUPDISCARD)
+		return;
+	/* Verify TLV1 length; has to be 6 octets for MAC address */
+	if (sup->sup_tag.tlv.len != sizeof(struct prp_sup_payload))
+		return;
 
-	if (!prp_check_lsdu_size(skb, rct))
-		return false;
+	/* RedBox MAC (TLV2), or TLV0 (end of TLVs) */
+	tlv = &sup->next;
+	if (tlv->type == PRP_TLV_REDBOX_MAC) {
+		if (tlv->len != sizeof(struct prp_sup_payload))
+			return;
+		/* Get next TLV, should be TLV0 */
+		tlv = skb_header_pointer(skb, offset + sizeof(*sup)
+					 + sizeof(struct prp_sup_payload),
+					 sizeof(*tlv), &tlv_buf);
+		if (!tlv)
+			return;
+	}
+	if (!(tlv->type == 0 && tlv->len == 0))
+		return;
 
-	return true;
+	cb->type = PRP_FRAME_SUP;
+	cb->sup_mode = sup->sup_tag.tlv.type;
+	cb->sup_seqnr = ntohs(sup->sup_tag.tag.sup_seqnr);
+	memcpy(cb->sup_mac, sup->payload.mac, ETH_ALEN);
 }
 
 /**
- * is_supervision_frame - Return true if supervision frame.
- * 	Maybe also get the node table entry here and store it in an argument.
+ * prp_classify - Parse @skb once and fill in its PRP_RX_CB() descriptor,
+ * 	which the rest of the RX path uses instead of looking at the frame
+ * 	again. Reads the Ethernet header, an optional VLAN tag, the RCT and
+ * 	the supervision TLVs without pulling or otherwise changing the skb.
+ * 	skb->data is at the end of the Ethernet header.
+ * @skb: Received frame
+ * @port: Port through which @skb was received
+ * @priv: PRP priv of the master
  */
-static bool is_supervision_frame(struct sk_buff *skb, struct prp_priv *priv)
+static void prp_classify(struct sk_buff *skb, struct prp_port *port,
+			 struct prp_priv *priv)
 {
-	struct ethhdr *ethhdr;
-	struct prp_tag *tag;
-	struct prp_sup_tlv *sup_tlv;
-	struct prp_sup_payload *payload;
-	int pulled = 0;
-
-	WARN_ON_ONCE(!skb_mac_header_was_set(skb));
-	ethhdr = eth_hdr(skb);
-
-	if (!ether_addr_equal(ethhdr->h_dest, priv->sup_multicast_addr))
-		return false;
-
-	if (ethhdr->h_proto != htons(ETH_P_PRP))
-		return false;
-
-	/* Pull Ethernet header to get start of supervision frame
-	 * (TODO: deal with VLAN?)
-	 */
-	if (!pskb_may_pull(skb, sizeof(*ethhdr)))
-		return false;
-	pulled += sizeof(struct ethhdr);
-	tag = skb_pull(skb, sizeof(*ethhdr));
-
-	/* Get tag - path, version, and sup_seqnr */
-	if (!pskb_may_pull(skb, sizeof(*tag)))
-		return false;
-	pulled += sizeof(*tag);
-	sup_tlv = skb_pull(skb, sizeof(*tag));
+	struct prp_rx_cb *cb = PRP_RX_CB(skb);
+	const struct ethhdr *ethhdr = eth_hdr(skb);
+	const struct prp_rct *rct;
+	struct prp_rct rct_buf;
+	unsigned int offset = 0;
+	__be16 proto = ethhdr->h_proto;
+
+	BUILD_BUG_ON(sizeof(*cb) > sizeof_field(struct sk_buff, cb));
+
+	cb->port = port;
+	cb->type = PRP_FRAME_NO_RCT;
+	cb->stamp = 0;
+
+	/* A tag the hardware did not strip is part of the frame, but not of
+	 * the LSDU. */
+	if (proto == htons(ETH_P_8021Q)) {
+		const struct vlan_hdr *vhdr;
+		struct vlan_hdr vhdr_buf;
+
+		vhdr = skb_header_pointer(skb, 0, VLAN_HLEN, &vhdr_buf);
+		if (!vhdr)
+			return;
+		proto = vhdr->h_vlan_encapsulated_proto;
+		offset = VLAN_HLEN;
+	}
 
-	/* Verify initial TLV1 type */
-	if (sup_tlv->type != PRP_TLV_DUPACCEPT
-	    && sup_tlv->type != PRP_TLV_DUPDISCARD)
-		goto out_false;
-	/* Verify TLV1 length; has to be 6 octets for MAC address */
-	if (sup_tlv->len != sizeof(struct prp_sup_payload))
-		goto out_false;
-	/* Get payload; move past sup_tlv */
-	if (!pskb_may_pull(skb, sizeof(*sup_tlv)))
-		goto out_false;
-	pulled += sizeof(*sup_tlv);
-	payload = skb_pull(skb, sizeof(*sup_tlv));
-	/* TODO: Process MAC */
-
-	/* Get RedBox MAC (TLV2), or TLV0 (end of TLVs); move past TLV1 */
-	if (!pskb_may_pull(skb, sizeof(*payload)))
-		goto out_false;
-	pulled += sizeof(*payload);
-	sup_tlv = skb_pull(skb, sizeof(*payload));
-	/* If anything other than RedBox MAC or end of TLV, return false */
-	if (sup_tlv->type == PRP_TLV_REDBOX_MAC) {
-		if(sup_tlv->len != sizeof(*payload))
-			return false;
+	/* NULL if PRP suffix not valid, i.e, 0x88FB */
+	rct = prp_get_rct(skb, &rct_buf);
+	if (!rct)
+		return;
 
-		/* Get next TLV, should be TLV0 */
-		if (!pskb_may_pull(skb, sizeof(*sup_tlv)))
-			goto out_false;
-		pulled += sizeof(*sup_tlv);
-		sup_tlv = skb_pull(skb, sizeof(*sup_tlv));
+	if (port->lan != prp_get_lan_id(rct)) {
+		cb->type = PRP_FRAME_WRONG_LAN;
+		trace_prp_rct_invalid(skb, port, rct, PRP_RCT_WRONG_LAN,
+				      skb->len - offset);
+		return;
 	}
 
-	if (!(sup_tlv->type == 0 && sup_tlv->len == 0)) {
-		goto out_false;
+	/* LSDU size is the Ethernet payload size, including the RCT */
+	if (prp_get_lsdu_size(rct) != skb->len - offset) {
+		cb->type = PRP_FRAME_BAD_LSDU;
+		trace_prp_rct_invalid(skb, port, rct, PRP_RCT_BAD_LSDU,
+				      skb->len - offset);
+		return;
 	}
 
-	/* Reset skb */
-	skb_push(skb, pulled);
-	return true;
+	cb->type = PRP_FRAME_DATA;
+	cb->seqnr = ntohs(rct->seqnr);
 
-out_false:
-	/* Reset skb->data */
-	skb_push(skb, pulled);
-	return false;
+	if (proto == htons(ETH_P_PRP)
+	    && ether_addr_equal(ethhdr->h_dest, priv->sup_multicast_addr))
+		prp_classify_sup(skb, offset, cb);
 }
 
-static inline void node_set_san(struct node_entry *node, struct prp_port *port)
+static inline void node_set_san(struct node_entry *node, struct prp_port *port,
+				struct prp_priv *priv)
 {
+	bool san_a = port->lan == 0xA;
+
 	/* We should NOT be getting non-PRP frames from the same source
 	 * over both the ports. May need to check for it...
 	 */
-	if (port->lan == 0xA) {
-		node->san_a = true;
-		node->san_b = false;
-	} else {
-		node->san_a = false;
-		node->san_b = true;
-	}
+	if (READ_ONCE(node->san_a) == san_a && READ_ONCE(node->san_b) == !san_a)
+		return;
+	WRITE_ONCE(node->san_a, san_a);
+	WRITE_ONCE(node->san_b, !san_a);
+	prp_queue_event(priv, PRP_EVENT_NODE_STATE, node->mac,
+			prp_node_state(san_a, !san_a), 0);
 }
 
 /**
  * prp_handle_sup - Process supervision frame and update node table.
- * 	Caller must hold the WRITE lock
- * @skb: sk_buff
+ * 	Called from the supervision work, holding the RCU read lock.
+ * @cb: Descriptor of the supervision frame, see prp_classify_sup()
  * @node: Node table entry
- * @port: Port through which we received the skb
+ * @spare: Window allocated beforehand, taken if @node has none
  */
-static void prp_handle_sup(struct sk_buff *skb, struct node_entry *node,
-			   struct prp_port *port)
+static void prp_handle_sup(const struct prp_rx_cb *cb, struct node_entry *node,
+			   struct prp_priv *priv, struct prp_window **spare)
 {
-	struct prp_tag *tag;
-	struct prp_sup_tlv *sup_tlv;
-	struct prp_sup_payload *payload;
-	unsigned char *source_mac;
-	int mode = 0;	/* duplicate discard or accept */
-	u16 sup_seqnr;
-
-	/* No need to check if we can pull since is_supervision_frame() did */
-	tag = skb_pull(skb, sizeof(struct ethhdr));
-	sup_seqnr = tag->sup_seqnr;
-
-	/* Get TLV1 */
-	sup_tlv = skb_pull(skb, sizeof(*tag));
-	mode = sup_tlv->type;
-	/* Get TLV1 payload, i.e, source MAC */
-	payload = skb_pull(skb, sizeof(*sup_tlv));
-	source_mac = payload->mac;
-
 	/* What to do with RedBox MAC? */
 
-	ether_addr_copy(node->mac, source_mac);
+	/* node->mac is the hash key and RCU readers may be walking the bucket,
+	 * so it is not rewritten here. For a DANP cb->sup_mac is the same as
+	 * the Ethernet source anyway.
+	 */
+	if (unlikely(!ether_addr_equal(node->mac, cb->sup_mac)))
+		PDEBUG("%s: DANP MAC differs from frame source\n", __func__);
+
 	/* node->san_a = node->san_b is set only here.
 	 * If allocation had failed in prp_add_node, retry it.
 	 */
-	node->san_a = node->san_b = false;
+	if (READ_ONCE(node->san_a) || READ_ONCE(node->san_b)) {
+		WRITE_ONCE(node->san_a, false);
+		WRITE_ONCE(node->san_b, false);
+		prp_queue_event(priv, PRP_EVENT_NODE_STATE, node->mac,
+				PRP_NODE_DANP, 0);
+	}
+	spin_lock_bh(&node->seq_lock);
 	if (!node->window) {
-		node->window = alloc_window(PRP_WINDOW_SIZE);
+		node->window = *spare;
+		*spare = NULL;
 		/* maybe delete node if it fails, so that we do not have
 		 * to check if it is not null everytime. */
-		if (unlikely(!node->window)) {
-			pr_warn("%s: failed to allocate window", __func__);
-		} else {
-			init_window(node->window);
+		if (unlikely(!node->window))
+			pr_warn_ratelimited("%s: failed to allocate window",
+					    __func__);
+	}
+	spin_unlock_bh(&node->seq_lock);
+}
+
+/**
+ * prp_sup_work - Process the supervision frames queued by RX.
+ * 	Supervision frames only update the node table, and every DANP sends
+ * 	one per LIFE_CHECK_INTERVAL, so they are taken off the RX path and
+ * 	handled here in batches; RX only does lookups and duplicate discard.
+ * 	Windows are allocated with GFP_KERNEL before looking up the node.
+ */
+static void prp_sup_work(struct work_struct *work)
+{
+	struct prp_priv *priv = container_of(work, struct prp_priv, sup_work);
+	struct prp_window *spare = NULL;
+	struct node_entry *node;
+	struct sk_buff_head q;
+	struct sk_buff *skb;
+	u64 t;
+
+	__skb_queue_head_init(&q);
+	spin_lock_bh(&priv->sup_queue.lock);
+	skb_queue_splice_init(&priv->sup_queue, &q);
+	spin_unlock_bh(&priv->sup_queue.lock);
+
+	while ((skb = __skb_dequeue(&q))) {
+		struct prp_rx_cb *cb = PRP_RX_CB(skb);
+
+		if (!spare)
+			spare = alloc_window(READ_ONCE(prp_window_size),
+					     READ_ONCE(prp_skew_hist),
+					     GFP_KERNEL);
+
+		rcu_read_lock();
+		/* Pruned in the meantime: it will be added again */
+		node = prp_get_node(eth_hdr(skb)->h_source, priv);
+		if (node) {
+			trace_prp_supervision(skb, cb);
+			t = prp_lat_start();
+			prp_handle_sup(cb, node, priv, &spare);
+			prp_lat_end(PRP_LAT_RX_SUP, t);
 		}
+		rcu_read_unlock();
+		consume_skb(skb);
+		cond_resched();
+	}
+	kfree(spare);
+}
+
+/* Hand a supervision frame to prp_sup_work() */
+static void prp_queue_sup(struct sk_buff *skb, struct prp_priv *priv)
+{
+	if (unlikely(skb_queue_len(&priv->sup_queue) >= PRP_SUP_QUEUE_LEN)) {
+		dev_core_stats_rx_dropped_inc(priv->ports[0].master);
+		kfree_skb(skb);
+		return;
+	}
+	skb_queue_tail(&priv->sup_queue, skb);
+	schedule_work(&priv->sup_work);
+}
+
+/**
+ * prp_sup_queue_init - Set up the supervision frame queue of @prp.
+ * 	Called from ndo_init.
+ */
+void prp_sup_queue_init(struct net_device *prp)
+{
+	struct prp_priv *priv = netdev_priv(prp);
+
+	skb_queue_head_init(&priv->sup_queue);
+	INIT_WORK(&priv->sup_work, prp_sup_work);
+}
+
+/**
+ * prp_sup_queue_destroy - Stop processing supervision frames of @prp.
+ * 	Called from ndo_uninit after the receive cells are gone, so nothing
+ * 	is queued anymore; the node table is still there.
+ */
+void prp_sup_queue_destroy(struct net_device *prp)
+{
+	struct prp_priv *priv = netdev_priv(prp);
+
+	cancel_work_sync(&priv->sup_work);
+	skb_queue_purge(&priv->sup_queue);
+}
+
+/**
+ * struct prp_rx_batch - State kept while processing one batch of frames.
+ * @cache: Nodes already looked up in this batch, by source MAC. Replaced
+ * 	round robin; control traffic comes from a handful of sources.
+ * @locked: Node whose seq_lock we are holding. It is kept across consecutive
+ * 	frames from the same source and only dropped when the source changes
+ * 	or the batch ends.
+ * @deliver: Frames to pass up to the master through GRO; delivered in place,
+ * 	they already point to the master and have the RCT removed.
+ * @pcpu: This CPU's stats of the device.
+ * @unique, @duplicate, @out_of_window, @lost, @out_of_order: Per LAN counters
+ * 	of this batch, added to @pcpu once at the end, see batch_flush_stats().
+ */
+struct prp_rx_batch {
+#define PRP_RX_BATCH_CACHE	8
+	struct node_entry	*cache[PRP_RX_BATCH_CACHE];
+	unsigned int		next;
+	struct node_entry	*locked;
+	struct list_head	deliver;
+	struct prp_pcpu_stats	*pcpu;
+	unsigned int		unique[2];
+	unsigned int		duplicate[2];
+	unsigned int		out_of_window[2];
+	unsigned int		lost[2];
+	unsigned int		out_of_order[2];
+};
+
+static void batch_flush_stats(struct prp_rx_batch *b)
+{
+	struct prp_pcpu_stats *s = b->pcpu;
+
+	u64_stats_update_begin(&s->syncp);
+	for (int i = 0; i < 2; i++) {
+		u64_stats_add(&s->lan[i].unique, b->unique[i]);
+		u64_stats_add(&s->lan[i].duplicate, b->duplicate[i]);
+		u64_stats_add(&s->lan[i].out_of_window, b->out_of_window[i]);
+		u64_stats_add(&s->lan[i].lost, b->lost[i]);
+		u64_stats_add(&s->lan[i].out_of_order, b->out_of_order[i]);
+	}
+	u64_stats_update_end(&s->syncp);
+}
+
+/* Number of bits set in @map from @start to @start + @n - 1 */
+static unsigned int window_weight(const unsigned long *map, unsigned int start,
+				  unsigned int n)
+{
+	unsigned int bit = start, w = 0;
+
+	for_each_set_bit_from(bit, map, start + n)
+		w++;
+	return w;
+}
+
+/*
+ * Losses found when sequence numbers leave the window: received on the other
+ * LAN only. Sequence numbers received on neither LAN are not counted; the
+ * sender numbers the frames it sends to other nodes from the same counter,
+ * so a gap is not a loss.
+ */
+struct prp_window_loss {
+	unsigned int	lan[2];
+};
+
+/*
+ * Count the bits set in @start .. @start + @n - 1 of the seen bitmap and of
+ * the per-LAN bitmaps into @w, then clear them.
+ */
+static void window_evict(struct prp_window *win, unsigned int start,
+			 unsigned int n, unsigned int w[3])
+{
+	unsigned long *maps[3] = {
+		win->seen, window_lan_map(win, 0), window_lan_map(win, 1)
+	};
+
+	for (int i = 0; i < 3; i++) {
+		w[i] += window_weight(maps[i], start, n);
+		bitmap_clear(maps[i], start, n);
+	}
+}
+
+/* Add the sequence numbers of @w (seen, on A, on B) seen on one LAN only */
+static inline void window_count_loss(const unsigned int w[3],
+				     struct prp_window_loss *loss)
+{
+	/* seen is A | B */
+	loss->lan[0] += w[0] - min(w[0], w[1]);
+	loss->lan[1] += w[0] - min(w[0], w[2]);
+}
+
+/**
+ * window_advance - Move the top of @win forward to @seqnr, forgetting the
+ * 	@delta sequence numbers that fall out of the window; @delta is less
+ * 	than @win->size. Adds the ones that were only seen on one LAN to
+ * 	@loss.
+ */
+static void window_advance(struct prp_window *win, u16 seqnr, int delta,
+			   struct prp_window_loss *loss)
+{
+	unsigned int size = win->size;
+	unsigned int w[3] = { };	/* seen, on A, on B */
+	unsigned int start, n;
+
+	/* Bits for seqnrs top+1 .. seqnr; may wrap around the end.
+	 * They still hold seqnrs top+1-size .. seqnr-size. */
+	start = (win->top + 1) & (size - 1);
+	n = min_t(unsigned int, delta, size - start);
+	window_evict(win, start, n, w);
+	if (n < delta)
+		window_evict(win, 0, delta - n, w);
+	window_count_loss(w, loss);
+
+	win->top = seqnr;
+}
+
+/* Start @win over with @seqnr as its top and nothing seen */
+static void window_reset(struct prp_window *win, u16 seqnr)
+{
+	bitmap_zero(win->seen, 3 * BITS_TO_LONGS(win->size) * BITS_PER_LONG);
+	win->top = seqnr;
+	win->valid = true;
+	win->lan_valid = 0;
+}
+
+/**
+ * window_refresh - Forget the word of @win that holds @bit if nothing was set
+ * 	in it for @forget jiffies, then mark it used at @now. Its bits are
+ * 	then from an earlier wrap of the sender's sequence number, not from
+ * 	the frames around @top. Adds the ones that were only seen on one LAN
+ * 	to @loss.
+ */
+static void window_refresh(struct prp_window *win, unsigned int bit,
+			   unsigned long now, unsigned long forget,
+			   struct prp_window_loss *loss)
+{
+	unsigned int block = bit / BITS_PER_LONG;
+	unsigned int w[3] = { };
+
+	if (time_after(now, win->block_time[block] + forget)) {
+		window_evict(win, block * BITS_PER_LONG,
+			     min_t(unsigned int, win->size, BITS_PER_LONG), w);
+		window_count_loss(w, loss);
+	}
+	win->block_time[block] = now;
+}
+
+/**
+ * window_order - Count a frame that arrives on @lan after a higher sequence
+ * 	number already did on the same LAN. Each LAN delivers in order, so
+ * 	this points to a problem on that LAN, or to a sender that reorders.
+ */
+static void window_order(struct node_entry *node, struct prp_window *win,
+			 u16 seqnr, unsigned int lan, struct prp_rx_batch *b)
+{
+	if (!(win->lan_valid & BIT(lan))) {
+		win->lan_valid |= BIT(lan);
+		win->lan_top[lan] = seqnr;
+	} else if ((s16)(seqnr - win->lan_top[lan]) < 0) {
+		node->cnt_ooo[lan]++;
+		b->out_of_order[lan]++;
+	} else {
+		win->lan_top[lan] = seqnr;
 	}
+}
+
+/* Remember when the first copy of the seqnr at @bit arrived */
+static inline void window_stamp(struct prp_window *win, unsigned int bit,
+				u32 stamp)
+{
+	if (win->stamp)
+		win->stamp[bit] = stamp;
+}
 
-	// if (likely(node->window))
-	// 	node->window->last_jiffies = node->time_last_in[port->lan&0x1];
+/**
+ * window_skew - Count the time between the first copy of the seqnr at @bit
+ * 	and the second one, which arrived at @stamp, in the node's and the
+ * 	device's skew histograms.
+ */
+static void window_skew(struct prp_window *win, unsigned int bit, u32 stamp,
+			struct prp_rx_batch *b)
+{
+	u32 first, us;
+	unsigned int bucket, lan;
 
-	return;
+	if (!win->stamp || !stamp)
+		return;
+	first = win->stamp[bit];
+	lan = first & 0x1;
+	/* Not measured, or a duplicate on the same LAN */
+	if (!first || lan == (stamp & 0x1))
+		return;
+
+	us = ((stamp >> 1) - (first >> 1)) & (U32_MAX >> 1);
+	bucket = us ? min_t(unsigned int, ilog2(us) + 1,
+			    PRP_SKEW_BUCKETS - 1) : 0;
+	win->skew->count[lan][bucket]++;
+	b->pcpu->skew[lan][bucket]++;
 }
 
+/* Result of register_frame() */
+enum prp_seq_result {
+	PRP_SEQ_UNIQUE,
+	PRP_SEQ_DUPLICATE,
+	PRP_SEQ_OUT_OF_WINDOW,	/* behind the window, which restarts there */
+};
+
 /**
- * register_frame - Update window and return true if duplicate.
+ * register_frame - Update window and return whether the frame is a duplicate.
+ * 	Caller must hold @node->seq_lock.
+ *
+ * 	The window remembers the last @win->size sequence numbers below and
+ * 	including the highest one seen, as one bit each. Since @win->size
+ * 	divides 2^16, seqnr & (size - 1) is the same bit before and after the
+ * 	16-bit wraparound, and comparing against the top with a signed 16-bit
+ * 	difference keeps working across it.
+ *
+ * 	A sender numbers all its frames from one counter, whatever their
+ * 	destination, and at 10G it wraps every few ms. Between two frames we
+ * 	receive, its sequence number can thus move by any amount, and once it
+ * 	wrapped, seem to move backwards. A sequence number @win->size or more
+ * 	away from the top, in either direction, restarts the window there, so
+ * 	that its other copy is still caught. If one LAN lags the other by
+ * 	@win->size frames or more, this happens on every frame and both
+ * 	copies are passed up; window_size has to be larger than that lag.
+ *
+ * 	Each word of the window also has the time a bit was last set in it.
+ * 	A word not used for entry_forget_time is cleared before it is used
+ * 	again, so that a bit left from an earlier wrap does not make a new
+ * 	frame look like a duplicate; see window_refresh(). The same goes for
+ * 	the whole window when the node has been silent for entry_forget_time,
+ * 	e.g, because it rebooted and restarted its sequence numbers. Within
+ * 	entry_forget_time, a gap of a whole number of wraps minus less than
+ * 	@win->size frames cannot be told from a duplicate.
+ *
+ * 	Besides the seen bitmap, one bitmap per LAN records which LAN each
+ * 	sequence number arrived on. A sequence number that leaves the window
+ * 	having been seen on one LAN only was lost on the other; see
+ * 	window_advance(). One that was seen on neither is not counted, since
+ * 	the sender also numbers the frames it sends to other nodes. This
+ * 	costs two more bit operations per frame and three bitmap clears per
+ * 	advance instead of one.
+ *
  * @node: Node entry.
  * @seqnr: Sequence number of incoming frame.
  * @lan: Port through which we received this frame.
+ * @stamp: Arrival time for the skew histograms, or 0.
+ * @b: Batch the frame is part of, for the device counters.
  */
-static bool register_frame(struct node_entry *node, u16 seqnr, u8 lan)
+static enum prp_seq_result register_frame(struct node_entry *node, u16 seqnr,
+					  u8 lan, u32 stamp,
+					  struct prp_rx_batch *b)
 {
-	struct window *win = node->window;
+	struct prp_window *win = node->window;
+	struct prp_window_loss loss = { };
+	unsigned long forget = msecs_to_jiffies(prp_entry_forget_time);
 	unsigned long now = jiffies;
-	unsigned long oldest, too_old;
-	bool is_dupe;
-	int oi;		/* Index of oldest entry; used for replacement. */
-	int size, i;
-
-	/* TODO
-	 * 	Can do it without comparison to find the oldest element.
-	 * 	It really is just a circular buffer, we just need to keep
-	 * 	track of the first position and increment it (mod winsize).
-	 *	Can store this cursor in the struct window itself.
-	 */
-	oldest = now;
-	size = PRP_WINDOW_SIZE;
-	for (i = 0; i < size; i++) {
-		/* found the entry with seqnr, or an empty space */
-		if (win[i].seqnr == seqnr || unlikely(win[i].seqnr == -1))
-			break;
-		if (time_before(win[i].time, oldest)) {
-			oi = i;
-			oldest = win[i].time;
-		}
+	unsigned int bit = seqnr & (win->size - 1);
+	unsigned int l = lan & 0x1;
+	unsigned int w[3] = { };
+	enum prp_seq_result res = PRP_SEQ_UNIQUE;
+	int delta;
+
+	if (unlikely(!win->valid) || time_after(now, win->last_in + forget)) {
+		window_reset(win, seqnr);
+		goto check;
 	}
-	if (i < size) {
-		if (unlikely(win[i].seqnr == -1)) {
-			/* found free space */
-			win[i].seqnr = seqnr;
-			is_dupe = false;
-		} else {
-			/* found it */
-			too_old = now - msecs_to_jiffies(ENTRY_FORGET_TIME);
-			if (time_before(win[i].time, too_old))
-				is_dupe = false;
-			else
-				is_dupe = true;
-		}
-		win[i].time = now;
+
+	delta = (s16)(seqnr - win->top);
+	if (delta >= (int)win->size || delta <= -(int)win->size) {
+		/* Too far from the top to tell; start over from here */
+		window_evict(win, 0, win->size, w);
+		window_count_loss(w, &loss);
+		window_reset(win, seqnr);
+		if (delta < 0)
+			res = PRP_SEQ_OUT_OF_WINDOW;
+	} else if (delta > 0) {
+		/* newer than anything so far */
+		window_advance(win, seqnr, delta, &loss);
+	}
+
+check:
+	window_refresh(win, bit, now, forget, &loss);
+	if (__test_and_set_bit(bit, win->seen)) {
+		node->cnt_dup++;
+		window_skew(win, bit, stamp, b);
+		res = PRP_SEQ_DUPLICATE;
 	} else {
-		win[oi].time = now;
-		win[oi].seqnr = seqnr;
-		is_dupe = false;
+		window_stamp(win, bit, stamp);
 	}
+	__set_bit(bit, window_lan_map(win, l));
+	window_order(node, win, seqnr, l, b);
 
-	PDEBUG("%s: seqnr=%d, lan=%x, dupe=%d\n", __func__, seqnr, lan, is_dupe);
-	node->time_last_in[lan&0x1] = now;
+	for (int i = 0; i < 2; i++) {
+		node->cnt_lost_lan[i] += loss.lan[i];
+		b->lost[i] += loss.lan[i];
+	}
+	win->last_in = now;
+	WRITE_ONCE(node->time_last_in[l], now);
 
-	return is_dupe;
+	return res;
 }
 
 /**
- * prp_is_duplicate - Return true if frame is duplicate.
- * 	Updates node table.
- * @skb: socket buff
+ * prp_check_seq - Register the frame in the node's window and return whether
+ * 	it is a duplicate. Caller must hold @node->seq_lock.
+ * @cb: Descriptor of the received frame
  * @node: Node table entry
- * @port: Port through which @skb was received
+ * @b: Batch the frame is part of
  */
-static bool prp_is_duplicate(struct sk_buff *skb, struct node_entry *node,
-			     struct prp_port *port)
+static enum prp_seq_result prp_check_seq(const struct prp_rx_cb *cb,
+					 struct node_entry *node,
+					 struct prp_rx_batch *b)
 {
-	struct prp_rct *rct;
-	unsigned char *mac;
-
 	if (unlikely(!node->window))
-		return false;
+		return PRP_SEQ_UNIQUE;
 
-	rct = prp_get_rct(skb);
-	// pr_info("%s: seqnr=%d\n", __func__, ntohs(rct->seqnr));
+	return register_frame(node, cb->seqnr, cb->port->lan, cb->stamp, b);
+}
 
-	mac = node->mac;
-	// pr_info("%s: source=%02x:%02x:%02x:%02x:%02x:%02x, node@%p\n", __func__,
-	// 	mac[0], mac[1], mac[2], mac[3], mac[4], mac[5], node);
+/**
+ * strip_rct - Remove the RCT from the end of @skb.
+ * 	The RCT may be in a page fragment; pskb_trim_rcsum() drops or shortens
+ * 	the fragments without linearizing. It only has to reallocate if the
+ * 	skb data is shared, and that can fail.
+ *
+ * 	With CHECKSUM_COMPLETE the hardware checksum covers the RCT too; the
+ * 	RCT's 6 bytes are subtracted from skb->csum so that it stays valid for
+ * 	GRO and the upper layers, instead of failing verification and being
+ * 	checked again in software. CHECKSUM_UNNECESSARY is not affected by the
+ * 	trailer.
+ */
+static int strip_rct(struct sk_buff *skb)
+{
+	return pskb_trim_rcsum(skb, skb->len - PRP_RCTLEN);
+}
 
-	return register_frame(node, ntohs(rct->seqnr), port->lan);
+static inline void batch_unlock(struct prp_rx_batch *b)
+{
+	if (b->locked) {
+		spin_unlock(&b->locked->seq_lock);
+		b->locked = NULL;
+	}
 }
 
-static void strip_rct(struct sk_buff *skb)
+static inline void batch_lock(struct prp_rx_batch *b, struct node_entry *node)
 {
-	// skb_dump(KERN_ERR, skb, false);
-	skb_trim(skb, skb->len - PRP_RCTLEN);
-	// skb_dump(KERN_ERR, skb, false);
+	if (b->locked == node)
+		return;
+	batch_unlock(b);
+	spin_lock(&node->seq_lock);
+	b->locked = node;
 }
 
 /**
- * prp_net_if - Forward frame to upper layer after stripping Ethernet header.
- *		All processing for PRP is assumed to be done if it is a
- *		PRP-tagged frame.
- * @skb: Socket buffer
- * @dev: PRP master device; master's stats are updated.
+ * batch_get_node - Get the node table entry for @mac, creating one if it does
+ * 	not exist. The node table is only searched once per source per batch.
  */
-static void prp_net_if(struct sk_buff *skb, struct net_device *dev)
+static struct node_entry *batch_get_node(struct prp_rx_batch *b,
+					 unsigned char *mac,
+					 struct prp_priv *priv)
 {
-	struct sk_buff	*clone_skb;
-	bool		multicast;
-	int		len, res;
+	struct node_entry *node;
+
+	for (int i = 0; i < PRP_RX_BATCH_CACHE; i++) {
+		node = b->cache[i];
+		if (node && ether_addr_equal(node->mac, mac))
+			return node;
+	}
+
+	node = prp_get_node(mac, priv);
+	if (!node) {
+		node = prp_add_node(mac, priv);
+		if (!node)
+			return NULL;
+	}
+	b->cache[b->next] = node;
+	b->next = (b->next + 1) % PRP_RX_BATCH_CACHE;
+	return node;
+}
 
-	multicast = skb->pkt_type == PACKET_MULTICAST;
+/**
+ * prp_recv_one - Duplicate discard for one PRP frame of a batch.
+ * 	Frames to pass up are put on @b->deliver; supervision frames are
+ * 	queued for prp_sup_work().
+ */
+static void prp_recv_one(struct sk_buff *skb, struct prp_priv *priv,
+			 struct prp_rx_batch *b, unsigned long now)
+{
+	struct prp_rx_cb *cb = PRP_RX_CB(skb);
+	struct prp_port *port = cb->port;
+	unsigned int lan = port->lan & 0x1;
+	enum prp_seq_result res;
+	struct node_entry *node;
+	u64 t;
 
-	clone_skb = skb_clone(skb, GFP_ATOMIC);
-	if (!clone_skb) {
-		pr_warn("%s: skb_clone returned NULL, not forwarding\n", __func__);
+	/* Get node table entry creating one if it does not exist. */
+	t = prp_lat_start();
+	node = batch_get_node(b, eth_hdr(skb)->h_source, priv);
+	t = prp_lat_end(PRP_LAT_RX_NODE_LOOKUP, t);
+	if (!node) {
+		PDEBUG("%s: cannot add node to node table\n", __func__);
+		/* Cannot discard duplicates without an entry */
+		b->unique[lan]++;
+		goto forward_upper;
+	}
+	WRITE_ONCE(node->time_last_in[lan], now);
+
+	batch_lock(b, node);
+	t = prp_lat_end(PRP_LAT_RX_LOCK_WAIT, t);
+	res = prp_check_seq(cb, node, b);
+	prp_lat_end(PRP_LAT_RX_REGISTER, t);
+	switch (res) {
+	case PRP_SEQ_DUPLICATE:
+		trace_prp_duplicate(skb, cb, node->window->top);
+		b->duplicate[lan]++;
+		consume_skb(skb);
+		return;
+	case PRP_SEQ_OUT_OF_WINDOW:
+		b->out_of_window[lan]++;
+		break;
+	default:
+		b->unique[lan]++;
+		break;
+	}
+
+	if (cb->type == PRP_FRAME_SUP) {
+		prp_queue_sup(skb, priv);
 		return;
 	}
 
-	/* Remove Ethernet header */
-	skb_pull(clone_skb, ETH_HLEN);
-	len = clone_skb->len;
-	res = netif_rx(clone_skb);
-	if (res == NET_RX_DROP) {
-		pr_warn("%s:%s: netif_rx DROPPED\n", __func__, dev->name);
-		/* TODO: Update stats */
+forward_upper:
+	/* Forward to upper layer after removing the trailer */
+	if (unlikely(strip_rct(skb))) {
+		kfree_skb(skb);
+		return;
+	}
+	list_add_tail(&skb->list, &b->deliver);
+}
+
+/**
+ * prp_recv_batch - Process a batch of frames received through the slaves and
+ * 	pass the ones that are not duplicates up to the master through GRO.
+ * 	Caller must be holding the RCU read lock.
+ *
+ * 	GRO has to happen here, after duplicate discard and with the RCT
+ * 	removed: on the slaves the RCT makes every PRP frame look like it has
+ * 	trailing garbage, so nothing gets merged there, and LRO is disabled
+ * 	on the slaves since it would merge the RCTs into the payload.
+ * 	The segments are held by @napi and flushed when the poll completes.
+ */
+static void prp_recv_batch(struct prp_priv *priv, struct sk_buff_head *batch,
+			   struct napi_struct *napi)
+{
+	struct prp_rx_batch b = { };
+	unsigned long now = jiffies;
+	struct sk_buff *skb, *next;
+	u64 t;
+
+	INIT_LIST_HEAD(&b.deliver);
+	b.pcpu = this_cpu_ptr(priv->pcpu_stats);
+
+	while ((skb = __skb_dequeue(batch)))
+		prp_recv_one(skb, priv, &b, now);
+	batch_unlock(&b);
+
+	batch_flush_stats(&b);
+
+	/* Not under any seq_lock; GRO may pass frames up right away */
+	list_for_each_entry_safe(skb, next, &b.deliver, list) {
+		skb_list_del_init(skb);
+		prp_stats_rx(priv, skb->len);
+		t = prp_lat_start();
+		napi_gro_receive(napi, skb);
+		prp_lat_end(PRP_LAT_RX_DELIVER, t);
+	}
+}
+
+/**
+ * prp_rx_poll - NAPI poll of a per-CPU receive cell of the master.
+ * 	Takes up to @budget frames queued by prp_recv_frame() and processes
+ * 	them as one batch. Like gro_cells, this NAPI instance belongs to the
+ * 	master, so GRO on it is controlled by the master's features, and
+ * 	frames still queued when the master goes down are dropped.
+ */
+static int prp_rx_poll(struct napi_struct *napi, int budget)
+{
+	struct prp_rx_cell *cell = container_of(napi, struct prp_rx_cell, napi);
+	struct prp_priv *priv = netdev_priv(napi->dev);
+	struct sk_buff_head batch;
+	struct sk_buff *skb;
+	int work_done = 0;
+
+	__skb_queue_head_init(&batch);
+	while (work_done < budget && (skb = __skb_dequeue(&cell->queue))) {
+		__skb_queue_tail(&batch, skb);
+		work_done++;
+	}
+
+	if (unlikely(!netif_running(napi->dev))) {
+		while ((skb = __skb_dequeue(&batch))) {
+			dev_core_stats_rx_dropped_inc(napi->dev);
+			kfree_skb(skb);
+		}
 	} else {
-		/* TODO: Update stats */
+		rcu_read_lock();
+		prp_recv_batch(priv, &batch, napi);
+		rcu_read_unlock();
+	}
+
+	if (work_done < budget)
+		napi_complete_done(napi, work_done);
+	return work_done;
+}
+
+/**
+ * prp_rx_cells_init - Set up the per-CPU receive cells of @prp.
+ * 	Called from ndo_init.
+ */
+int prp_rx_cells_init(struct net_device *prp)
+{
+	struct prp_priv *priv = netdev_priv(prp);
+	int cpu;
+
+	priv->rx_cells = alloc_percpu(struct prp_rx_cell);
+	if (!priv->rx_cells)
+		return -ENOMEM;
+
+	for_each_possible_cpu(cpu) {
+		struct prp_rx_cell *cell = per_cpu_ptr(priv->rx_cells, cpu);
+
+		__skb_queue_head_init(&cell->queue);
+		netif_napi_add(prp, &cell->napi, prp_rx_poll);
+		napi_enable(&cell->napi);
 	}
+	return 0;
+}
+
+/**
+ * prp_rx_cells_destroy - Tear down the per-CPU receive cells of @prp.
+ * 	Called from ndo_uninit; the RX handlers are unregistered by then, so
+ * 	nothing is queued anymore.
+ */
+void prp_rx_cells_destroy(struct net_device *prp)
+{
+	struct prp_priv *priv = netdev_priv(prp);
+	int cpu;
+
+	if (!priv->rx_cells)
+		return;
+
+	for_each_possible_cpu(cpu) {
+		struct prp_rx_cell *cell = per_cpu_ptr(priv->rx_cells, cpu);
+
+		napi_disable(&cell->napi);
+		netif_napi_del(&cell->napi);
+		__skb_queue_purge(&cell->queue);
+	}
+	free_percpu(priv->rx_cells);
+	priv->rx_cells = NULL;
 }
 
 /**
  * prp_recv_frame - Callback for frame reception by slave devices.
- * 	Does the following:
- * 		Check for a valid PRP RCT; forward to upper layer if not.
- *		Handle supervision frame and update node table.
+ * 	Frames without a valid PRP RCT are retargeted to the master and
+ * 	passed up in place with RX_HANDLER_ANOTHER.
+ * 	PRP frames are queued on this CPU's receive cell of the master; they
+ * 	are processed together with the other frames of the burst by
+ * 	prp_rx_poll(), which does the following:
  *		Duplicate discard and update node table.
+ *		Queue supervision frames for prp_sup_work().
  */
 rx_handler_result_t prp_recv_frame(struct sk_buff **pskb)
 {
@@ -340,11 +857,9 @@ rx_handler_result_t prp_recv_frame(struct sk_buff **pskb)
 	struct prp_priv *priv;
 	struct ethhdr *ethhdr;
 	struct prp_port *port;
+	struct prp_rx_cell *cell;
 	struct node_entry *node;
-	unsigned long now = jiffies;
-	unsigned char *source_mac;
-
-	// PDEBUG("%s:%s: PID=%d", __func__, dev->name, current->pid);
+	u64 t;
 
 	/* Not sure why; saw this in the net/hsr module */
 	if (unlikely(skb->pkt_type == PACKET_LOOPBACK))
@@ -363,66 +878,52 @@ rx_handler_result_t prp_recv_frame(struct sk_buff **pskb)
 
 	port =  get_rx_handler_data(dev);
 	if (!port)
-		goto finish_pass;
-
-	priv = netdev_priv(port->master);
+		return RX_HANDLER_PASS;
 
-	// PDEBUG("%s: mac_header=%d, network_header=%d", __func__, skb->mac_header,
-	// 	skb->network_header);
-	skb_push(skb, ETH_HLEN);
-	skb_reset_mac_header(skb);
-	skb_reset_mac_len(skb);
+	t = prp_lat_start();
+	/* We trim the RCT off; taps on the slave may still hold a reference */
+	skb = skb_share_check(skb, GFP_ATOMIC);
+	if (unlikely(!skb))
+		return RX_HANDLER_CONSUMED;
+	*pskb = skb;
 
+	priv = netdev_priv(port->master);
 	skb->dev = port->master;
+	ethhdr = eth_hdr(skb);
 
-	source_mac = eth_hdr(skb)->h_source;
-	/* Unlock only at the end. */
-	write_lock(&priv->node_table_lock);
-	/* Get node table entry creating one if it does not exist. */
-	node = prp_get_node(source_mac, priv);
-	/* Create entry? */
-	if (!node) {
-		/* NOTE: if this is a supervision frame, prp_handle_sup will
-		 * replace the MAC address with the one in the supervision
-		 * frame's payload. */
-		node = prp_add_node(source_mac, priv);
-		if (!node) {
-			pr_warn("%s: cannot add node to node table\n", __func__);
-			goto finish_pass;
+	prp_classify(skb, port, priv);
+	prp_lat_end(PRP_LAT_RX_CLASSIFY, t);
+	trace_prp_rx_frame(skb, PRP_RX_CB(skb));
+	prp_stats_lan_inc(priv, port->lan, received);
+	/* Not a PRP frame, nothing to discard. */
+	if (PRP_RX_CB(skb)->type < PRP_FRAME_DATA) {
+		if (PRP_RX_CB(skb)->type == PRP_FRAME_WRONG_LAN)
+			prp_stats_lan_inc(priv, port->lan, wrong_lan);
+		prp_stats_rx(priv, skb->len);
+		node = prp_get_node(ethhdr->h_source, priv);
+		if (!node)
+			node = prp_add_node(ethhdr->h_source, priv);
+		if (node) {
+			WRITE_ONCE(node->time_last_in[port->lan&0x1], jiffies);
+			node_set_san(node, port, priv);
 		}
+		return RX_HANDLER_ANOTHER;
 	}
-	node->time_last_in[port->lan&0x1] = now;
 
-	/* Not a PRP frame */
-	if (!valid_rct(skb, port)) {
-		node_set_san(node, port);
-		goto forward_upper;
-	}
+	/* Taken here, since frames may wait in the cell for a while */
+	if (READ_ONCE(prp_skew_hist))
+		PRP_RX_CB(skb)->stamp = prp_skew_stamp(port->lan);
 
-	if (prp_is_duplicate(skb, node, port)) {
+	cell = this_cpu_ptr(priv->rx_cells);
+	if (unlikely(!netif_running(port->master) ||
+		     skb_queue_len(&cell->queue) > READ_ONCE(netdev_max_backlog))) {
+		dev_core_stats_rx_dropped_inc(port->master);
 		kfree_skb(skb);
-		goto finish_consumed;
+		return RX_HANDLER_CONSUMED;
 	}
+	__skb_queue_tail(&cell->queue, skb);
+	if (skb_queue_len(&cell->queue) == 1)
+		napi_schedule(&cell->napi);
 
-	if (is_supervision_frame(skb, priv)) {
-		// unsigned char *mac = eth_hdr(skb)->h_source;
-		// pr_info("%s: supervision frame from %08x:%08x:%08x:%08x:%08x:%08x\n",
-		// 	__func__, mac[0], mac[1], mac[2], mac[3], mac[4], mac[5]);
-		prp_handle_sup(skb, node, port);
-		goto finish_consumed;
-	}
-
-	strip_rct(skb);
-
-forward_upper:
-	/* Forward to upper layer after removing any header and trailer */
-	prp_net_if(skb, port->master);
-	kfree_skb(skb);
-
-finish_consumed:
-	write_unlock(&priv->node_table_lock);
 	return RX_HANDLER_CONSUMED;
-
-finish_pass:
-	return RX_HANDLER_PASS;
 }
@@ -3,6 +3,73 @@
 
 #include <linux/netdevice.h>
 
+/**
+ * struct prp_rx_cell - Per-CPU queue of received frames waiting to be
+ * 	processed as a batch by the master's NAPI poll.
+ */
+struct prp_rx_cell {
+	struct sk_buff_head	queue;
+	struct napi_struct	napi;
+};
+
+/* Classification of a received frame, see prp_classify() */
+enum prp_frame_type {
+	PRP_FRAME_NO_RCT,	/* no PRP suffix; from a SAN */
+	PRP_FRAME_WRONG_LAN,	/* RCT with the other LAN's id */
+	PRP_FRAME_BAD_LSDU,	/* LSDU size does not match the frame */
+	PRP_FRAME_DATA,		/* valid RCT */
+	PRP_FRAME_SUP,		/* valid RCT, supervision frame */
+};
+
+/**
+ * struct prp_rx_cb - Descriptor of a received frame, filled in once by
+ * 	prp_classify() and kept in skb->cb while the frame waits in a
+ * 	prp_rx_cell.
+ * @port: Port through which the frame was received.
+ * @seqnr: Sequence number from the RCT; PRP_FRAME_DATA and _SUP only.
+ * @sup_seqnr: Supervision sequence number; PRP_FRAME_SUP only.
+ * @type: enum prp_frame_type
+ * @sup_mode: TLV1 type, PRP_TLV_DUPDISCARD or PRP_TLV_DUPACCEPT.
+ * @sup_mac: MAC address of the DANP from TLV1.
+ * @stamp: Arrival time on the slave for the skew histogram, 0 if not
+ * 	measured; see prp_skew_stamp().
+ */
+struct prp_rx_cb {
+	struct prp_port		*port;
+	u32			stamp;
+	u16			seqnr;
+	u16			sup_seqnr;
+	u8			type;
+	u8			sup_mode;
+	unsigned char		sup_mac[ETH_ALEN];
+};
+
+#define PRP_RX_CB(skb)	((struct prp_rx_cb *)(skb)->cb)
+
+/**
+ * prp_skew_stamp - Arrival time of a frame in us, with the LAN it arrived on
+ * 	in bit 0. Wraps after about 35 minutes, which is much longer than any
+ * 	two copies stay in the window. Never 0.
+ */
+static inline u32 prp_skew_stamp(u8 lan)
+{
+	u32 us = div_u64(ktime_get_ns(), NSEC_PER_USEC);
+	u32 stamp = (us << 1) | (lan & 0x1);
+
+	return stamp ?: 2;
+}
+
 rx_handler_result_t prp_recv_frame(struct sk_buff **pskb);
 
+/* Supervision frames waiting for prp_sup_work(), per device */
+#define PRP_SUP_QUEUE_LEN	1024
+
+void prp_sup_queue_init(struct net_device *prp);
+
+void prp_sup_queue_destroy(struct net_device *prp);
+
+int prp_rx_cells_init(struct net_device *prp);
+
+void prp_rx_cells_destroy(struct net_device *prp);
+
 #endif /* __PRP_RX_H */
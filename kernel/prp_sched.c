@@ -0,0 +1,100 @@
+#include <linux/netdevice.h>
+#include <linux/workqueue.h>
+#include <linux/mutex.h>
+#include <linux/timer.h>
+#include "prp_main.h"
+#include "prp_node.h"
+#include "prp_tx.h"
+#include "prp_sched.h"
+#include "debug.h"
+
+/*
+ * Periodic work of all PRP devices: supervision frames every
+ * LIFE_CHECK_INTERVAL and node table pruning every PRUNE_PERIOD.
+ * Instead of a timer and a work per device, one work of each kind walks
+ * all devices, so that the number of wakeups does not grow with the number
+ * of devices (e.g, one per network namespace).
+ *
+ * Both are rounded to whole seconds to fire together with other timers.
+ * Pruning is deferrable; it may wait while the CPU is idle. Supervision
+ * is not, since peers declare a LAN lost after missing two intervals.
+ */
+
+/* Devices, see prp_sched_add(); also keeps them alive for the works */
+static LIST_HEAD(prp_sched_list);
+static DEFINE_MUTEX(prp_sched_lock);
+
+static void prp_sup_tick(struct work_struct *work);
+static void prp_prune_tick(struct work_struct *work);
+
+static DECLARE_DELAYED_WORK(prp_sup_work, prp_sup_tick);
+static DECLARE_DEFERRABLE_WORK(prp_prune_work, prp_prune_tick);
+
+static void prp_sched_queue(struct delayed_work *dwork, unsigned int ms)
+{
+	queue_delayed_work(system_power_efficient_wq, dwork,
+			   round_jiffies_relative(msecs_to_jiffies(ms)));
+}
+
+/* Send the supervision frames of every device that is up */
+static void prp_sup_tick(struct work_struct *work)
+{
+	struct prp_priv *priv;
+
+	mutex_lock(&prp_sched_lock);
+	list_for_each_entry(priv, &prp_sched_list, sched_list)
+		if (READ_ONCE(priv->sup_active))
+			prp_send_supervision(priv->ports[0].master);
+	if (!list_empty(&prp_sched_list))
+		prp_sched_queue(&prp_sup_work, LIFE_CHECK_INTERVAL);
+	mutex_unlock(&prp_sched_lock);
+}
+
+/* Prune the node tables of all devices */
+static void prp_prune_tick(struct work_struct *work)
+{
+	struct prp_priv *priv;
+
+	mutex_lock(&prp_sched_lock);
+	list_for_each_entry(priv, &prp_sched_list, sched_list) {
+		prp_prune_nodes(priv);
+		cond_resched();
+	}
+	if (!list_empty(&prp_sched_list))
+		prp_sched_queue(&prp_prune_work, PRUNE_PERIOD);
+	mutex_unlock(&prp_sched_lock);
+}
+
+/**
+ * prp_sched_add - Start the periodic work of @priv.
+ * 	Supervision frames are only sent while @priv->sup_active is set.
+ */
+void prp_sched_add(struct prp_priv *priv)
+{
+	mutex_lock(&prp_sched_lock);
+	if (list_empty(&prp_sched_list)) {
+		prp_sched_queue(&prp_sup_work, LIFE_CHECK_INTERVAL);
+		prp_sched_queue(&prp_prune_work, PRUNE_PERIOD);
+	}
+	list_add_tail(&priv->sched_list, &prp_sched_list);
+	mutex_unlock(&prp_sched_lock);
+}
+
+/**
+ * prp_sched_del - Stop the periodic work of @priv. Once this returns, the
+ * 	works are done with @priv. The works stop rescheduling themselves
+ * 	when the last device is gone.
+ */
+void prp_sched_del(struct prp_priv *priv)
+{
+	mutex_lock(&prp_sched_lock);
+	list_del(&priv->sched_list);
+	mutex_unlock(&prp_sched_lock);
+}
+
+/* Called on module exit, after all devices are gone */
+void prp_sched_exit(void)
+{
+	cancel_delayed_work_sync(&prp_sup_work);
+	cancel_delayed_work_sync(&prp_prune_work);
+}
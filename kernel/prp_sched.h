@@ -0,0 +1,12 @@
+#ifndef __PRP_SCHED_H
+#define __PRP_SCHED_H
+
+#include "prp_main.h"
+
+void prp_sched_add(struct prp_priv *priv);
+
+void prp_sched_del(struct prp_priv *priv);
+
+void prp_sched_exit(void);
+
+#endif /* __PRP_SCHED_H */
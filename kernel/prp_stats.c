@@ -0,0 +1,147 @@
+#include <linux/netdevice.h>
+#include <linux/ethtool.h>
+#include "prp_main.h"
+#include "prp_stats.h"
+#include "debug.h"
+
+/**
+ * prp_stats_fold - Sum up the per-CPU counters of @priv into @total.
+ */
+void prp_stats_fold(struct prp_priv *priv, struct prp_stats *total)
+{
+	int cpu;
+
+	memset(total, 0, sizeof(*total));
+
+	for_each_possible_cpu(cpu) {
+		const struct prp_pcpu_stats *s = per_cpu_ptr(priv->pcpu_stats, cpu);
+		struct prp_stats snap;
+		unsigned int start;
+
+		do {
+			start = u64_stats_fetch_begin(&s->syncp);
+			snap.rx_packets = u64_stats_read(&s->rx_packets);
+			snap.rx_bytes = u64_stats_read(&s->rx_bytes);
+			snap.tx_packets = u64_stats_read(&s->tx_packets);
+			snap.tx_bytes = u64_stats_read(&s->tx_bytes);
+			for (int i = 0; i < 2; i++) {
+				const struct prp_lan_stats *l = &s->lan[i];
+				struct prp_lan_counters *c = &snap.lan[i];
+
+				c->sent = u64_stats_read(&l->sent);
+				c->received = u64_stats_read(&l->received);
+				c->unique = u64_stats_read(&l->unique);
+				c->duplicate = u64_stats_read(&l->duplicate);
+				c->wrong_lan = u64_stats_read(&l->wrong_lan);
+				c->out_of_window = u64_stats_read(&l->out_of_window);
+				c->lost = u64_stats_read(&l->lost);
+				c->out_of_order = u64_stats_read(&l->out_of_order);
+			}
+		} while (u64_stats_fetch_retry(&s->syncp, start));
+
+		total->rx_packets += snap.rx_packets;
+		total->rx_bytes += snap.rx_bytes;
+		total->tx_packets += snap.tx_packets;
+		total->tx_bytes += snap.tx_bytes;
+		for (int i = 0; i < 2; i++) {
+			total->lan[i].sent += snap.lan[i].sent;
+			total->lan[i].received += snap.lan[i].received;
+			total->lan[i].unique += snap.lan[i].unique;
+			total->lan[i].duplicate += snap.lan[i].duplicate;
+			total->lan[i].wrong_lan += snap.lan[i].wrong_lan;
+			total->lan[i].out_of_window += snap.lan[i].out_of_window;
+			total->lan[i].lost += snap.lan[i].lost;
+			total->lan[i].out_of_order += snap.lan[i].out_of_order;
+		}
+	}
+}
+
+/* Sum up the skew histograms of all CPUs */
+void prp_skew_fold(struct prp_priv *priv, u64 total[2][PRP_SKEW_BUCKETS])
+{
+	int cpu;
+
+	memset(total, 0, 2 * PRP_SKEW_BUCKETS * sizeof(u64));
+	for_each_possible_cpu(cpu) {
+		const struct prp_pcpu_stats *s = per_cpu_ptr(priv->pcpu_stats, cpu);
+
+		for (int i = 0; i < 2; i++)
+			for (int b = 0; b < PRP_SKEW_BUCKETS; b++)
+				total[i][b] += READ_ONCE(s->skew[i][b]);
+	}
+}
+
+/* ndo_get_stats64; dev_get_stats() adds the core drop counters */
+void prp_get_stats64(struct net_device *dev, struct rtnl_link_stats64 *stats)
+{
+	struct prp_priv *priv = netdev_priv(dev);
+	struct prp_stats total;
+
+	prp_stats_fold(priv, &total);
+
+	stats->rx_packets = total.rx_packets;
+	stats->rx_bytes = total.rx_bytes;
+	stats->tx_packets = total.tx_packets;
+	stats->tx_bytes = total.tx_bytes;
+	/* Frames from the wrong LAN are still passed up, but point to
+	 * miswiring. */
+	stats->rx_errors = total.lan[0].wrong_lan + total.lan[1].wrong_lan;
+}
+
+/*
+ * ethtool -S
+ * Per LAN, in the order of struct prp_lan_counters: lan_a_sent, ...
+ */
+static const char prp_lan_stat_names[][ETH_GSTRING_LEN] = {
+	"sent",
+	"received",
+	"unique",
+	"duplicate",
+	"wrong_lan",
+	"out_of_window",
+	"lost",
+	"out_of_order",
+};
+
+#define PRP_LAN_STATS_LEN	ARRAY_SIZE(prp_lan_stat_names)
+
+static int prp_get_sset_count(struct net_device *dev, int sset)
+{
+	switch (sset) {
+	case ETH_SS_STATS:
+		return 2 * PRP_LAN_STATS_LEN;
+	default:
+		return -EOPNOTSUPP;
+	}
+}
+
+static void prp_get_strings(struct net_device *dev, u32 sset, u8 *data)
+{
+	if (sset != ETH_SS_STATS)
+		return;
+
+	for (int i = 0; i < 2; i++)
+		for (int j = 0; j < PRP_LAN_STATS_LEN; j++)
+			ethtool_sprintf(&data, "lan_%c_%s", 'a' + i,
+					prp_lan_stat_names[j]);
+}
+
+static void prp_get_ethtool_stats(struct net_device *dev,
+				  struct ethtool_stats *estats, u64 *data)
+{
+	struct prp_priv *priv = netdev_priv(dev);
+	struct prp_stats total;
+
+	BUILD_BUG_ON(sizeof(struct prp_lan_counters) !=
+		     PRP_LAN_STATS_LEN * sizeof(u64));
+
+	prp_stats_fold(priv, &total);
+	memcpy(data, total.lan, sizeof(total.lan));
+}
+
+const struct ethtool_ops prp_ethtool_ops = {
+	.get_link		= ethtool_op_get_link,
+	.get_sset_count		= prp_get_sset_count,
+	.get_strings		= prp_get_strings,
+	.get_ethtool_stats	= prp_get_ethtool_stats,
+};
@@ -0,0 +1,121 @@
+#ifndef __PRP_STATS_H
+#define __PRP_STATS_H
+
+#include <linux/netdevice.h>
+#include <linux/u64_stats_sync.h>
+#include "prp_main.h"
+
+/**
+ * struct prp_lan_stats - PRP counters of one LAN, see IEC 62439-3:2016 Annex.
+ * @sent: Frames sent through the port of this LAN.
+ * @received: Frames received through the port, PRP or not.
+ * @unique: PRP frames received here first, i.e, passed up or handled.
+ * @duplicate: PRP frames received here second and discarded.
+ * @wrong_lan: PRP frames with the other LAN's id (CntErrWrongLanX).
+ * @out_of_window: PRP frames too far behind the drop window to tell
+ * 	whether they are duplicates; passed up, and the window starts over
+ * 	from them so that their other copy is discarded.
+ * @lost: Sequence numbers received on the other LAN only.
+ * @out_of_order: PRP frames received after a higher sequence number from
+ * 	the same node on this LAN.
+ */
+struct prp_lan_stats {
+	u64_stats_t	sent;
+	u64_stats_t	received;
+	u64_stats_t	unique;
+	u64_stats_t	duplicate;
+	u64_stats_t	wrong_lan;
+	u64_stats_t	out_of_window;
+	u64_stats_t	lost;
+	u64_stats_t	out_of_order;
+};
+
+/**
+ * struct prp_pcpu_stats - Per-CPU counters of a PRP device.
+ * 	Only updated from softirq context on the local CPU, so no atomics are
+ * 	needed; @syncp lets 32-bit readers get consistent 64-bit values.
+ * 	Summed up only when read, see prp_stats_fold().
+ * 	Drops are counted in dev->core_stats, which the core adds itself.
+ * @lan: Indexed by lan & 0x1, i.e, 0 for LAN A, 1 for LAN B.
+ * @skew: Skew histogram of all nodes, see struct prp_skew_hist. Not
+ * 	covered by @syncp; read like the latency histograms.
+ */
+struct prp_pcpu_stats {
+	u64_stats_t		rx_packets;
+	u64_stats_t		rx_bytes;
+	u64_stats_t		tx_packets;
+	u64_stats_t		tx_bytes;
+	struct prp_lan_stats	lan[2];
+	struct u64_stats_sync	syncp;
+	u64			skew[2][PRP_SKEW_BUCKETS];
+};
+
+void prp_skew_fold(struct prp_priv *priv, u64 total[2][PRP_SKEW_BUCKETS]);
+
+/* Totals over all CPUs, in the order of the ethtool strings */
+struct prp_lan_counters {
+	u64	sent;
+	u64	received;
+	u64	unique;
+	u64	duplicate;
+	u64	wrong_lan;
+	u64	out_of_window;
+	u64	lost;
+	u64	out_of_order;
+};
+
+struct prp_stats {
+	u64			rx_packets;
+	u64			rx_bytes;
+	u64			tx_packets;
+	u64			tx_bytes;
+	struct prp_lan_counters	lan[2];
+};
+
+void prp_stats_fold(struct prp_priv *priv, struct prp_stats *total);
+
+void prp_get_stats64(struct net_device *dev, struct rtnl_link_stats64 *stats);
+
+extern const struct ethtool_ops prp_ethtool_ops;
+
+static inline void prp_stats_rx(struct prp_priv *priv, unsigned int len)
+{
+	struct prp_pcpu_stats *s = this_cpu_ptr(priv->pcpu_stats);
+
+	u64_stats_update_begin(&s->syncp);
+	u64_stats_inc(&s->rx_packets);
+	u64_stats_add(&s->rx_bytes, len);
+	u64_stats_update_end(&s->syncp);
+}
+
+static inline void prp_stats_tx(struct prp_priv *priv, unsigned int len)
+{
+	struct prp_pcpu_stats *s = this_cpu_ptr(priv->pcpu_stats);
+
+	u64_stats_update_begin(&s->syncp);
+	u64_stats_inc(&s->tx_packets);
+	u64_stats_add(&s->tx_bytes, len);
+	u64_stats_update_end(&s->syncp);
+}
+
+/* Add @n to counter @field of struct prp_lan_stats for LAN @lan */
+#define prp_stats_lan_add(priv, lan, field, n)				\
+do {									\
+	struct prp_pcpu_stats *__s = this_cpu_ptr((priv)->pcpu_stats);	\
+									\
+	u64_stats_update_begin(&__s->syncp);				\
+	u64_stats_add(&__s->lan[(lan) & 0x1].field, n);			\
+	u64_stats_update_end(&__s->syncp);				\
+} while (0)
+
+/* Increment counter @field of struct prp_lan_stats for LAN @lan */
+#define prp_stats_lan_inc(priv, lan, field)				\
+do {									\
+	struct prp_pcpu_stats *__s = this_cpu_ptr((priv)->pcpu_stats);	\
+									\
+	u64_stats_update_begin(&__s->syncp);				\
+	u64_stats_inc(&__s->lan[(lan) & 0x1].field);			\
+	u64_stats_update_end(&__s->syncp);				\
+} while (0)
+
+#endif /* __PRP_STATS_H */
@@ -0,0 +1,272 @@
+/*
+ * Tracepoints of the PRP module, in the "prp" trace system:
+ * 	/sys/kernel/tracing/events/prp/
+ * Defined in prp_main.c.
+ */
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM prp
+
+#if !defined(__PRP_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define __PRP_TRACE_H
+
+#include <linux/tracepoint.h>
+#include <linux/netdevice.h>
+#include <linux/if_ether.h>
+#include "prp_main.h"
+#include "prp_rx.h"
+
+/* Why a frame with a PRP suffix was not treated as a PRP frame */
+#define PRP_RCT_WRONG_LAN	0
+#define PRP_RCT_BAD_LSDU	1
+
+#define show_rct_reason(reason)						\
+	__print_symbolic(reason,					\
+			 { PRP_RCT_WRONG_LAN,	"wrong_lan" },		\
+			 { PRP_RCT_BAD_LSDU,	"bad_lsdu" })
+
+#define show_frame_type(type)						\
+	__print_symbolic(type,						\
+			 { PRP_FRAME_NO_RCT,	"no_rct" },		\
+			 { PRP_FRAME_WRONG_LAN,	"wrong_lan" },		\
+			 { PRP_FRAME_BAD_LSDU,	"bad_lsdu" },		\
+			 { PRP_FRAME_DATA,	"data" },		\
+			 { PRP_FRAME_SUP,	"sup" })
+
+/*
+ * @tstamp is the receive timestamp of the slave, 0 if no one asked for
+ * timestamps; compare it with the trace timestamp for the time spent in
+ * the stack.
+ */
+TRACE_EVENT(prp_rx_frame,
+
+	TP_PROTO(const struct sk_buff *skb, const struct prp_rx_cb *cb),
+
+	TP_ARGS(skb, cb),
+
+	TP_STRUCT__entry(
+		__string(	dev,		cb->port->dev->name	)
+		__array(	u8,		src,	ETH_ALEN	)
+		__field(	u8,		lan			)
+		__field(	u8,		type			)
+		__field(	u16,		seqnr			)
+		__field(	unsigned int,	len			)
+		__field(	s64,		tstamp			)
+	),
+
+	TP_fast_assign(
+		__assign_str(dev, cb->port->dev->name);
+		memcpy(__entry->src, eth_hdr(skb)->h_source, ETH_ALEN);
+		__entry->lan = cb->port->lan;
+		__entry->type = cb->type;
+		__entry->seqnr = cb->type >= PRP_FRAME_DATA ? cb->seqnr : 0;
+		__entry->len = skb->len;
+		__entry->tstamp = ktime_to_ns(skb->tstamp);
+	),
+
+	TP_printk("dev=%s lan=%X src=%pM type=%s seqnr=%u len=%u tstamp=%lld",
+		  __get_str(dev), __entry->lan, __entry->src,
+		  show_frame_type(__entry->type), __entry->seqnr, __entry->len,
+		  __entry->tstamp)
+);
+
+TRACE_EVENT(prp_rct_invalid,
+
+	TP_PROTO(const struct sk_buff *skb, const struct prp_port *port,
+		 const struct prp_rct *rct, int reason, unsigned int lsdu),
+
+	TP_ARGS(skb, port, rct, reason, lsdu),
+
+	TP_STRUCT__entry(
+		__string(	dev,		port->dev->name		)
+		__array(	u8,		src,	ETH_ALEN	)
+		__field(	u8,		lan			)
+		__field(	u8,		rct_lan			)
+		__field(	u16,		seqnr			)
+		__field(	u16,		rct_lsdu		)
+		__field(	unsigned int,	lsdu			)
+		__field(	int,		reason			)
+	),
+
+	TP_fast_assign(
+		__assign_str(dev, port->dev->name);
+		memcpy(__entry->src, eth_hdr(skb)->h_source, ETH_ALEN);
+		__entry->lan = port->lan;
+		__entry->rct_lan = prp_get_lan_id(rct);
+		__entry->seqnr = ntohs(rct->seqnr);
+		__entry->rct_lsdu = prp_get_lsdu_size(rct);
+		__entry->lsdu = lsdu;
+		__entry->reason = reason;
+	),
+
+	TP_printk("dev=%s lan=%X src=%pM reason=%s seqnr=%u rct_lan=%X rct_lsdu=%u lsdu=%u",
+		  __get_str(dev), __entry->lan, __entry->src,
+		  show_rct_reason(__entry->reason), __entry->seqnr,
+		  __entry->rct_lan, __entry->rct_lsdu, __entry->lsdu)
+);
+
+/* @top is the highest sequence number seen from the node */
+TRACE_EVENT(prp_duplicate,
+
+	TP_PROTO(const struct sk_buff *skb, const struct prp_rx_cb *cb,
+		 u16 top),
+
+	TP_ARGS(skb, cb, top),
+
+	TP_STRUCT__entry(
+		__array(	u8,		src,	ETH_ALEN	)
+		__field(	u8,		lan			)
+		__field(	u16,		seqnr			)
+		__field(	u16,		top			)
+		__field(	s64,		tstamp			)
+	),
+
+	TP_fast_assign(
+		memcpy(__entry->src, eth_hdr(skb)->h_source, ETH_ALEN);
+		__entry->lan = cb->port->lan;
+		__entry->seqnr = cb->seqnr;
+		__entry->top = top;
+		__entry->tstamp = ktime_to_ns(skb->tstamp);
+	),
+
+	TP_printk("lan=%X src=%pM seqnr=%u top=%u tstamp=%lld",
+		  __entry->lan, __entry->src, __entry->seqnr, __entry->top,
+		  __entry->tstamp)
+);
+
+TRACE_EVENT(prp_supervision,
+
+	TP_PROTO(const struct sk_buff *skb, const struct prp_rx_cb *cb),
+
+	TP_ARGS(skb, cb),
+
+	TP_STRUCT__entry(
+		__array(	u8,		src,	ETH_ALEN	)
+		__array(	u8,		danp,	ETH_ALEN	)
+		__field(	u8,		lan			)
+		__field(	u8,		mode			)
+		__field(	u16,		seqnr			)
+		__field(	u16,		sup_seqnr		)
+	),
+
+	TP_fast_assign(
+		memcpy(__entry->src, eth_hdr(skb)->h_source, ETH_ALEN);
+		memcpy(__entry->danp, cb->sup_mac, ETH_ALEN);
+		__entry->lan = cb->port->lan;
+		__entry->mode = cb->sup_mode;
+		__entry->seqnr = cb->seqnr;
+		__entry->sup_seqnr = cb->sup_seqnr;
+	),
+
+	TP_printk("lan=%X src=%pM danp=%pM mode=%s seqnr=%u sup_seqnr=%u",
+		  __entry->lan, __entry->src, __entry->danp,
+		  __entry->mode == PRP_TLV_DUPACCEPT ? "dup_accept" : "dup_discard",
+		  __entry->seqnr, __entry->sup_seqnr)
+);
+
+TRACE_EVENT(prp_node_add,
+
+	TP_PROTO(const struct net_device *dev, const unsigned char *mac),
+
+	TP_ARGS(dev, mac),
+
+	TP_STRUCT__entry(
+		__string(	dev,		dev->name		)
+		__array(	u8,		mac,	ETH_ALEN	)
+	),
+
+	TP_fast_assign(
+		__assign_str(dev, dev->name);
+		memcpy(__entry->mac, mac, ETH_ALEN);
+	),
+
+	TP_printk("dev=%s mac=%pM", __get_str(dev), __entry->mac)
+);
+
+/* @age_ms is the time since the node was last heard on either LAN */
+TRACE_EVENT(prp_node_prune,
+
+	TP_PROTO(const struct net_device *dev, const unsigned char *mac,
+		 unsigned int age_ms),
+
+	TP_ARGS(dev, mac, age_ms),
+
+	TP_STRUCT__entry(
+		__string(	dev,		dev->name		)
+		__array(	u8,		mac,	ETH_ALEN	)
+		__field(	unsigned int,	age_ms			)
+	),
+
+	TP_fast_assign(
+		__assign_str(dev, dev->name);
+		memcpy(__entry->mac, mac, ETH_ALEN);
+		__entry->age_ms = age_ms;
+	),
+
+	TP_printk("dev=%s mac=%pM age_ms=%u",
+		  __get_str(dev), __entry->mac, __entry->age_ms)
+);
+
+TRACE_EVENT(prp_tx_duplicate,
+
+	TP_PROTO(const struct net_device *dev, const struct sk_buff *skb,
+		 u16 seqnr),
+
+	TP_ARGS(dev, skb, seqnr),
+
+	TP_STRUCT__entry(
+		__string(	dev,		dev->name		)
+		__array(	u8,		dst,	ETH_ALEN	)
+		__field(	u16,		seqnr			)
+		__field(	u16,		protocol		)
+		__field(	unsigned int,	len			)
+	),
+
+	TP_fast_assign(
+		__assign_str(dev, dev->name);
+		memcpy(__entry->dst, eth_hdr(skb)->h_dest, ETH_ALEN);
+		__entry->seqnr = seqnr;
+		__entry->protocol = ntohs(eth_hdr(skb)->h_proto);
+		__entry->len = skb->len;
+	),
+
+	TP_printk("dev=%s dst=%pM seqnr=%u proto=0x%04x len=%u",
+		  __get_str(dev), __entry->dst, __entry->seqnr,
+		  __entry->protocol, __entry->len)
+);
+
+TRACE_EVENT(prp_tx_san,
+
+	TP_PROTO(const struct net_device *dev, const struct sk_buff *skb,
+		 u8 lan),
+
+	TP_ARGS(dev, skb, lan),
+
+	TP_STRUCT__entry(
+		__string(	dev,		dev->name		)
+		__array(	u8,		dst,	ETH_ALEN	)
+		__field(	u8,		lan			)
+		__field(	u16,		protocol		)
+		__field(	unsigned int,	len			)
+	),
+
+	TP_fast_assign(
+		__assign_str(dev, dev->name);
+		memcpy(__entry->dst, eth_hdr(skb)->h_dest, ETH_ALEN);
+		__entry->lan = lan;
+		__entry->protocol = ntohs(eth_hdr(skb)->h_proto);
+		__entry->len = skb->len;
+	),
+
+	TP_printk("dev=%s lan=%X dst=%pM proto=0x%04x len=%u",
+		  __get_str(dev), __entry->lan, __entry->dst,
+		  __entry->protocol, __entry->len)
+);
+
+#endif /* __PRP_TRACE_H */
+
+/* This part must be outside protection */
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE prp_trace
+#include <trace/define_trace.h>
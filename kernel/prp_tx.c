@@ -1,22 +1,33 @@
 #include <linux/netdevice.h>
 #include <linux/etherdevice.h>
 #include <linux/if_vlan.h>
+#include <net/sch_generic.h>
 #include <asm/current.h>
 #include "prp_main.h"
 #include "prp_dev.h"
 #include "prp_tx.h"
 #include "prp_node.h"
+#include "prp_stats.h"
+#include "prp_trace.h"
+#include "prp_latency.h"
 #include "debug.h"
 
 
 /**
  * TX
+ *
+ * The LSDU is the Ethernet payload including the RCT, but not a VLAN tag.
+ * A tag that the slave will insert in hardware is not part of skb->len;
+ * one that is already in the frame is.
  */
 static inline void prp_set_lsdu_size(struct prp_rct *rct, struct sk_buff *skb)
 {
-	u16 lsdu_size = skb->len - skb->mac_len;
+	u16 lsdu_size = skb->len - ETH_HLEN;
 	u16 temp = rct->lan_id_and_lsdu_size;
 
+	if (eth_hdr(skb)->h_proto == htons(ETH_P_8021Q))
+		lsdu_size -= VLAN_HLEN;
+
 	rct->lan_id_and_lsdu_size = htons((ntohs(temp) & 0xf000)
 					  | (lsdu_size & 0x0fff));
 }
@@ -34,18 +45,68 @@ static inline void prp_rct_set_lan_id(struct prp_rct *rct, u8 lan_id)
 }
 
 
+/**
+ * prp_put_rct - Make room for the RCT at the end of @skb, which is about to
+ * 	be sent through skb->dev.
+ * 	The RCT goes right after the data whenever the frame is linear, which
+ * 	takes the room the stack left for needed_tailroom, or else a
+ * 	reallocation of the linear part only. Only a frame whose data is in
+ * 	page fragments gets a fragment of its own for the RCT, so that the
+ * 	payload is not copied; if the slave cannot do scatter/gather, it
+ * 	would linearize the frame anyway, so that is done here instead.
+ * 	A clone is made private first; that copies its linear part only.
+ * 	Returns NULL on failure.
+ */
+static struct prp_rct *prp_put_rct(struct sk_buff *skb)
+{
+	int i = skb_shinfo(skb)->nr_frags;
+	struct page *page;
+	void *data;
+
+	/* A fragment would end up before the frag_list data */
+	if (skb_is_nonlinear(skb) &&
+	    (!(skb->dev->features & NETIF_F_SG) || skb_has_frag_list(skb) ||
+	     i >= MAX_SKB_FRAGS)) {
+		if (skb_linearize(skb))
+			return NULL;
+	}
+
+	if (!skb_is_nonlinear(skb)) {
+		if ((skb_cloned(skb) || skb_tailroom(skb) < PRP_RCTLEN) &&
+		    pskb_expand_head(skb, 0, PRP_RCTLEN, GFP_ATOMIC))
+			return NULL;
+		return skb_put(skb, PRP_RCTLEN);
+	}
+
+	/* Adding a fragment writes to skb_shinfo(), which a clone shares */
+	if (skb_unclone(skb, GFP_ATOMIC))
+		return NULL;
+	data = netdev_alloc_frag(PRP_RCTLEN);
+	if (!data)
+		return NULL;
+	page = virt_to_head_page(data);
+	skb_fill_page_desc(skb, i, page, data - page_address(page), PRP_RCTLEN);
+	skb->len += PRP_RCTLEN;
+	skb->data_len += PRP_RCTLEN;
+	skb->truesize += PRP_RCTLEN;
+	return data;
+}
+
 /**
  * Appends and sets the RCT for the frame.
  */
-inline void prp_add_rct(u8 lan, u16 seqnr, struct sk_buff *skb)
+static int prp_add_rct(u8 lan, u16 seqnr, struct sk_buff *skb)
 {
 	struct prp_rct *rct;
 
-	rct = skb_put(skb, PRP_RCTLEN);
+	rct = prp_put_rct(skb);
+	if (!rct)
+		return -ENOMEM;
 	prp_set_lsdu_size(rct, skb);
 	rct->prp_suffix = htons(PRP_SUFFIX);
 	rct->seqnr = htons(seqnr);
 	prp_rct_set_lan_id(rct, lan);
+	return 0;
 }
 
 /**
@@ -61,14 +122,14 @@ static int prp_prepare_skb(u16 seqnr, u8 lan, struct sk_buff *skb,
 		return -EINVAL;
 	}
 
-	prp_add_rct(lan, seqnr, skb);
-
-	return 0;
+	return prp_add_rct(lan, seqnr, skb);
 }
 
 /**
  * prp_pad_frame - Check if frame is a VLAN and pad accordingly.
  * 	Called only for DANPs. See section 4.2.7.4.1 of IEC 62439-3:2016 p. 28
+ * 	A tag in skb metadata is inserted by the slave on the wire and is not
+ * 	counted here, so such frames are padded like untagged ones.
  * @skb: sk_buff received from prp_dev_xmit
  * @dev: PRP device
  */
@@ -88,78 +149,368 @@ static int prp_pad_frame(struct sk_buff *skb, struct net_device *dev)
 	return 0;
 }
 
+/**
+ * prp_next_seqnr - Take the next sequence number of @priv for a frame sent
+ * 	from this CPU, whose batch is @b. Each CPU takes PRP_SEQNR_BLOCK
+ * 	numbers from @priv->seqnr at once, so that the shared counter is
+ * 	written once per block instead of once per frame. A block is only
+ * 	used in the jiffy it was taken in; the rest of it is skipped after
+ * 	that, so that a CPU that sends rarely does not use old numbers.
+ *
+ * 	Frames sent at the same time from different CPUs are therefore not
+ * 	numbered in the order they are sent. A receiver sees the blocks of
+ * 	the CPUs sending to it interleaved, and counts the frames numbered
+ * 	lower than one it already got as out of order. Duplicate discard is
+ * 	not affected as long as its window is larger than PRP_SEQNR_BLOCK
+ * 	times the number of CPUs sending at once.
+ * 	Called with BHs disabled.
+ */
+static u16 prp_next_seqnr(struct prp_priv *priv, struct prp_tx_batch *b)
+{
+	unsigned long now = jiffies;
+
+	if (!b->seq_left || b->seq_time != now) {
+		b->seq_next = atomic_fetch_add(PRP_SEQNR_BLOCK, &priv->seqnr);
+		b->seq_left = PRP_SEQNR_BLOCK;
+		b->seq_time = now;
+	}
+	b->seq_left--;
+	return b->seq_next++ % (1 << 16);
+}
+
 static void send_san(struct sk_buff *skb, struct net_device *dev,
 		     struct prp_priv *priv, bool san_a, bool san_b)
 {
-	struct prp_port *ports = priv->ports;
+	struct prp_port *port = san_a ? &priv->ports[0] : &priv->ports[1];
+	unsigned int len = skb->len;
+	int res;
+	u64 t;
 
-	if (san_a)
-		skb->dev = ports[0].dev;
-	else
-		skb->dev = ports[1].dev;
+	skb->dev = port->dev;
 
+	trace_prp_tx_san(dev, skb, port->lan);
 	skb_tx_timestamp(skb);
-	if (dev_queue_xmit(skb))
-		netdev_warn(dev, "failed to send to san_%x\n", san_a ? 0xA : 0xB);
+	t = prp_lat_start();
+	res = dev_queue_xmit(skb);
+	prp_lat_end(PRP_LAT_TX_XMIT, t);
+	if (net_xmit_eval(res)) {
+		dev_core_stats_tx_dropped_inc(dev);
+		return;
+	}
+	prp_stats_lan_inc(priv, port->lan, sent);
+	prp_stats_tx(priv, len);
+}
+
+/*
+ * TX queue of slave @dev for @skb: the one the core picked on the master,
+ * folded into the slave's range if it has fewer. Only used by
+ * prp_xmit_direct(); dev_queue_xmit() picks the queue again, see
+ * prp_set_tx_queues().
+ */
+static inline u16 prp_slave_txq(const struct sk_buff *skb,
+				const struct net_device *dev)
+{
+	u16 qid = skb_get_queue_mapping(skb);
+
+	return likely(qid < dev->real_num_tx_queues) ?
+	       qid : qid % dev->real_num_tx_queues;
+}
+
+static inline void prp_txq_lock(struct net_device *dev,
+				struct netdev_queue *txq)
+{
+	if (!(dev->features & NETIF_F_LLTX))
+		__netif_tx_lock(txq, smp_processor_id());
+}
+
+static inline void prp_txq_unlock(struct net_device *dev,
+				  struct netdev_queue *txq)
+{
+	if (!(dev->features & NETIF_F_LLTX))
+		__netif_tx_unlock(txq);
+}
+
+/*
+ * Whether frames for @txq may skip its qdisc: only if it has none, i.e, the
+ * slave runs noqueue there. Anything else, mqprio, taprio, tbf, etc, gets
+ * the frames through dev_queue_xmit() and batches them itself when it
+ * dequeues in bulk.
+ */
+static inline bool prp_txq_direct(struct netdev_queue *txq)
+{
+	return !rcu_dereference_bh(txq->qdisc)->enqueue &&
+	       !netif_xmit_frozen_or_drv_stopped(txq);
+}
+
+/**
+ * prp_xmit_direct - Hand the frames on @q straight to the driver of @port,
+ * 	back to back with xmit_more set on all but the last one for each TX
+ * 	queue, so that it rings its doorbell once for the batch. This is only
+ * 	done on TX queues without a qdisc, see prp_txq_direct(). Each frame
+ * 	stays on the queue the core picked on the master, see
+ * 	prp_slave_txq().
+ *
+ * 	A TX queue is checked once, before the first frame goes to it, while
+ * 	its lock is held; xmit_more is only set when the next frame goes to
+ * 	the same queue. The only way to stop after a frame sent with
+ * 	xmit_more is then the driver stopping its queue, or returning
+ * 	NETDEV_TX_BUSY, which it may only do with the queue stopped. Drivers
+ * 	ring the doorbell themselves when they stop the queue, see
+ * 	__netdev_tx_sent_queue().
+ *
+ * 	Frames that are not sent are left on @q in order, for
+ * 	dev_queue_xmit(); so are the ones validate_xmit_skb_list() asks to
+ * 	requeue. Returns the number of frames sent. Called with BHs disabled.
+ */
+static unsigned int prp_xmit_direct(struct sk_buff_head *q,
+				    struct prp_port *port)
+{
+	struct net_device *dev = port->dev;
+	struct sk_buff_head ready, requeue;
+	struct netdev_queue *txq = NULL;
+	struct sk_buff *skb, *seg, *next;
+	unsigned int sent = 0;
+	bool again = false;
+	netdev_tx_t res;
+	u16 qid;
+
+	/* What dev_queue_xmit() would do before the driver: insert the VLAN
+	 * tag, linearise, etc. if the slave cannot */
+	__skb_queue_head_init(&ready);
+	__skb_queue_head_init(&requeue);
+	while ((skb = __skb_dequeue(q))) {
+		skb = validate_xmit_skb_list(skb, dev, &again);
+		skb_list_walk_safe(skb, seg, next) {
+			skb_mark_not_on_list(seg);
+			__skb_queue_tail(again ? &requeue : &ready, seg);
+		}
+		if (again) {
+			/* Left for dev_queue_xmit(), with the rest of @q */
+			skb_queue_splice(&requeue, q);
+			break;
+		}
+	}
+
+	while ((skb = __skb_dequeue(&ready))) {
+		qid = prp_slave_txq(skb, dev);
+		if (txq != netdev_get_tx_queue(dev, qid)) {
+			if (txq)
+				prp_txq_unlock(dev, txq);
+			txq = netdev_get_tx_queue(dev, qid);
+			prp_txq_lock(dev, txq);
+			if (!prp_txq_direct(txq)) {
+				__skb_queue_head(&ready, skb);
+				break;
+			}
+		} else if (netif_xmit_frozen_or_drv_stopped(txq)) {
+			/* The driver stopped it and rang the doorbell */
+			__skb_queue_head(&ready, skb);
+			break;
+		}
+		skb_set_queue_mapping(skb, qid);
+		if (dev_nit_active(dev))
+			dev_queue_xmit_nit(skb, dev);
+		next = skb_peek(&ready);
+		res = netdev_start_xmit(skb, dev, txq,
+					next && prp_slave_txq(next, dev) == qid);
+		if (res == NETDEV_TX_BUSY) {
+			__skb_queue_head(&ready, skb);
+			break;
+		}
+		if (!net_xmit_eval(res))
+			sent++;
+	}
+	if (txq)
+		prp_txq_unlock(dev, txq);
+
+	skb_queue_splice(&ready, q);
+	return sent;
+}
+
+/**
+ * prp_tx_flush - Send the frames in @b through the slaves, one LAN after
+ * 	the other. With tx_direct, the default, each slave gets the whole
+ * 	batch at once on its TX queues without a qdisc. Everything else goes
+ * 	through dev_queue_xmit() one by one; a qdisc on the slave batches
+ * 	those frames for the driver when it dequeues them in bulk.
+ */
+void prp_tx_flush(struct prp_tx_batch *b, struct net_device *dev)
+{
+	struct prp_priv *priv = netdev_priv(dev);
+	struct sk_buff *skb;
+	unsigned int sent;
+	u64 t;
+
+	for (int i = 0; i < 2; i++) {
+		struct sk_buff_head *q = &b->q[i];
+		struct prp_port *port = &priv->ports[i];
+
+		if (skb_queue_empty(q))
+			continue;
+		if (unlikely(!is_up(port->dev))) {
+			__skb_queue_purge(q);
+			continue;
+		}
+
+		sent = 0;
+		t = prp_lat_start();
+		if (READ_ONCE(prp_tx_direct))
+			sent = prp_xmit_direct(q, port);
+		while ((skb = __skb_dequeue(q)))
+			if (!net_xmit_eval(dev_queue_xmit(skb)))
+				sent++;
+		prp_lat_end(PRP_LAT_TX_XMIT, t);
+		prp_stats_lan_add(priv, port->lan, sent, sent);
+	}
 }
 
 /**
  * TX
  *
- * Send skb through both slave interfaces.
+ * Prepare the copies of @skb for both slave interfaces and add them to @b,
+ * see prp_tx_flush(). Frames to a SAN are sent right away.
+ * Runs under rcu_read_lock_bh() from ndo_start_xmit.
  */
-void prp_send_skb(struct sk_buff *skb, struct net_device *dev)
+void prp_queue_skb(struct sk_buff *skb, struct net_device *dev,
+		   struct prp_tx_batch *b)
 {
 	struct prp_priv *prp_priv = netdev_priv(dev);
 	struct prp_port *ports = prp_priv->ports;
 	struct node_entry *node;
 	struct sk_buff *skb_copy;
 	unsigned char *mac = eth_hdr(skb)->h_dest;
+	unsigned int len;
+	bool queued = false;
 	u16 seqnr;
+	u64 t;
 
-	read_lock(&prp_priv->node_table_lock);
+	rcu_read_lock();
+	t = prp_lat_start();
 	node = prp_get_node(mac, prp_priv);
+	prp_lat_end(PRP_LAT_TX_NODE_LOOKUP, t);
 	if (node) {
+		bool san_a = READ_ONCE(node->san_a);
+		bool san_b = READ_ONCE(node->san_b);
+
 		/* Both false => DANP. Both true => new entry */
-		if (node->san_a ^ node->san_b) {
-			read_unlock(&prp_priv->node_table_lock);
-			send_san(skb, dev, prp_priv, node->san_a, node->san_b);
+		if (san_a ^ san_b) {
+			rcu_read_unlock();
+			send_san(skb, dev, prp_priv, san_a, san_b);
 			return;
 		}
 	}
-	read_unlock(&prp_priv->node_table_lock);
+	rcu_read_unlock();
+
+	if (prp_pad_frame(skb, dev) < 0) {
+		/* skb_put_padto() freed it */
+		dev_core_stats_tx_dropped_inc(dev);
+		return;
+	}
 
-	if (prp_pad_frame(skb, dev) < 0)
+	/* The slaves would checksum up to the end of the frame, RCT
+	 * included. Resolve it now, once for both copies. */
+	if (skb->ip_summed == CHECKSUM_PARTIAL && skb_checksum_help(skb)) {
+		dev_core_stats_tx_dropped_inc(dev);
+		kfree_skb(skb);
 		return;
+	}
 
-	seqnr = atomic_fetch_add(1, &prp_priv->seqnr) % (1 << 16);
+	len = skb->len;
+	seqnr = prp_next_seqnr(prp_priv, b);
+	trace_prp_tx_duplicate(dev, skb, seqnr);
 	for (int i = 0; i < 2; ++i) {
-		/* Need to copy skb since clone will only clone the skb_buff
-		 * and the refcount will be 1. Tailroom is extended for the RCT.
-		 */
 		if (unlikely(!is_up(ports[i].dev)))
 			continue;
 
-		skb_copy = skb_copy_expand(skb, 0, skb_tailroom(skb) + PRP_RCTLEN,
-					   GFP_ATOMIC);
-		skb_reset_mac_len(skb_copy);
+		/* Only the RCT differs between the two copies. LAN B gets the
+		 * frame itself unless someone else holds it; prp_put_rct()
+		 * makes a clone private, copying only its linear part. LAN A
+		 * gets a copy. Only payload in page fragments is shared with
+		 * it: pskb_copy() still copies the linear part, which is the
+		 * whole frame if it is linear. A linear frame, or one the
+		 * slave would linearize, is copied with room for the RCT
+		 * instead. A plain clone would share skb_shinfo() and leave
+		 * no place for a private RCT.
+		 */
+		t = prp_lat_start();
+		if (i == 1 && !skb_shared(skb)) {
+			skb_copy = skb;
+			skb = NULL;
+		} else if (skb_is_nonlinear(skb) &&
+			   (ports[i].dev->features & NETIF_F_SG)) {
+			skb_copy = pskb_copy(skb, GFP_ATOMIC);
+		} else {
+			skb_copy = skb_copy_expand(skb, skb_headroom(skb),
+						   PRP_RCTLEN, GFP_ATOMIC);
+		}
 		if (!skb_copy) {
-			PDEBUG("%s: skb_copy_expand returned NULL... continuing",
+			PDEBUG("%s: cannot copy frame... continuing",
 				__func__);
 			continue;
 		}
+		skb_reset_mac_len(skb_copy);
+		skb_copy->dev = ports[i].dev;
 
 		/* Creates PRP tagged frame */
-		if (prp_prepare_skb(seqnr, ports[i].lan, skb_copy, dev) < 0)
-			return;
-
-		skb_copy->dev = ports[i].dev;
+		if (prp_prepare_skb(seqnr, ports[i].lan, skb_copy, dev) < 0) {
+			kfree_skb(skb_copy);
+			continue;
+		}
+		prp_lat_end(PRP_LAT_TX_COPY, t);
 
 		skb_tx_timestamp(skb_copy);
-		if (dev_queue_xmit(skb_copy))
-			netdev_warn(dev, "failed to send over port %x", ports[i].lan);
+		__skb_queue_tail(&b->q[i], skb_copy);
+		queued = true;
 	}
-	kfree_skb(skb);
+
+	/* Counted once for the master, if it is handed to either LAN */
+	if (queued)
+		prp_stats_tx(prp_priv, len);
+	else
+		dev_core_stats_tx_dropped_inc(dev);
+	/* NULL if it went to LAN B */
+	consume_skb(skb);
+}
+
+/**
+ * prp_tx_batches_init - Set up the per-CPU TX batches of @prp.
+ * 	Called from ndo_init.
+ */
+int prp_tx_batches_init(struct net_device *prp)
+{
+	struct prp_priv *priv = netdev_priv(prp);
+	int cpu;
+
+	priv->tx_batches = alloc_percpu(struct prp_tx_batch);
+	if (!priv->tx_batches)
+		return -ENOMEM;
+
+	for_each_possible_cpu(cpu)
+		prp_tx_batch_init(per_cpu_ptr(priv->tx_batches, cpu));
+	return 0;
+}
+
+/**
+ * prp_tx_batches_destroy - Free the per-CPU TX batches of @prp.
+ * 	Called from ndo_uninit. A batch is always flushed before
+ * 	ndo_start_xmit returns without xmit_more, so they are empty.
+ */
+void prp_tx_batches_destroy(struct net_device *prp)
+{
+	struct prp_priv *priv = netdev_priv(prp);
+	int cpu;
+
+	if (!priv->tx_batches)
+		return;
+
+	for_each_possible_cpu(cpu) {
+		struct prp_tx_batch *b = per_cpu_ptr(priv->tx_batches, cpu);
+
+		__skb_queue_purge(&b->q[0]);
+		__skb_queue_purge(&b->q[1]);
+	}
+	free_percpu(priv->tx_batches);
+	priv->tx_batches = NULL;
 }
 
 /**
@@ -171,14 +522,17 @@ static struct sk_buff *prp_init_skb(struct net_device *prp)
 {
 	struct sk_buff *skb;
 	struct prp_priv *priv = netdev_priv(prp);
-	int hlen, tlen;
+	int hlen, tlen, len;
 
 	/* Get needed headroom and tailroom */
 	hlen = LL_RESERVED_SPACE(prp);
 	tlen = prp->needed_tailroom;
 
-	skb = dev_alloc_skb(sizeof(struct prp_sup_tag)
-			    + sizeof(struct prp_sup_payload) + hlen + tlen);
+	/* Room for the padding and the RCT too, so that the whole frame
+	 * stays linear; the ETH header goes into the headroom */
+	len = max_t(int, sizeof(struct prp_sup_tag)
+		    + sizeof(struct prp_sup_payload), ETH_ZLEN - ETH_HLEN);
+	skb = dev_alloc_skb(len + PRP_RCTLEN + hlen + tlen);
 	if (!skb)
 		return skb;
 
@@ -227,29 +581,25 @@ static inline __be16 sup_tag_path_and_ver(unsigned path, unsigned ver)
 }
 
 /**
- * prp_send_supervision: Called when priv->prp_sup_timer expires.
- * 	Send a PRP supervision frame.
+ * prp_build_sup - Build the supervision frame of @prp for LAN @lan, RCT
+ * 	included. The sequence numbers are filled in when it is sent, see
+ * 	prp_send_supervision().
  */
-void prp_send_supervision(struct net_device *prp)
+static struct sk_buff *prp_build_sup(struct net_device *prp, u8 lan)
 {
 	struct prp_sup_payload *payload;
 	struct prp_sup_tag *tag;
-	struct prp_priv *priv = netdev_priv(prp);
 	struct sk_buff *skb;
-	u16 sup_seqnr;
 
 	skb = prp_init_skb(prp);
-	if (!skb) {
-		WARN_ONCE(1, "PRP: Could not send supervision frame\n");
-		return;
-	}
+	if (!skb)
+		return NULL;
 
 	/* set up tag after ETH hdr - path, version, and sup_seqnr */
 	tag = skb_put(skb, sizeof(*tag));
 	tag->tag.path_and_ver = ntohs(sup_tag_path_and_ver(PRP_SUP_TAG_PATH,
 						       PRP_SUP_TAG_VERSION));
-	sup_seqnr = atomic_fetch_add(1, &priv->sup_seqnr) & 0xffff;
-	tag->tag.sup_seqnr = htons(sup_seqnr);
+	tag->tag.sup_seqnr = 0;
 	tag->tlv.type = PRP_TLV_DUPDISCARD;
 	tag->tlv.len = sizeof(*payload);
 
@@ -261,10 +611,162 @@ void prp_send_supervision(struct net_device *prp)
 	 * TLV0.type = TLV0.len = 0
 	 */
 	if (skb_put_padto(skb, ETH_ZLEN)) {
+		/* skb_put_padto() freed it */
 		pr_err("%s: failed to pad to %d octets\n", __func__, ETH_ZLEN);
-		return;
+		return NULL;
 	}
 
-	/* duplicate and append RCT */
-	prp_send_skb(skb, prp);
+	/* prp_init_skb() left room for the RCT after the padding, so it
+	 * lands at the tail of the linear area, where
+	 * prp_send_supervision() writes the sequence number */
+	if (WARN_ON_ONCE(skb_tailroom(skb) < PRP_RCTLEN) ||
+	    prp_add_rct(lan, 0, skb)) {
+		kfree_skb(skb);
+		return NULL;
+	}
+	return skb;
+}
+
+/**
+ * prp_sup_rebuild - Build the supervision frames of @prp for both LANs
+ * 	and replace the old ones, spares included. Called when the device is
+ * 	created and when its MAC address changes, under RTNL. On failure the
+ * 	old frames are kept.
+ */
+int prp_sup_rebuild(struct net_device *prp)
+{
+	struct prp_priv *priv = netdev_priv(prp);
+	struct sk_buff *skb[2], *spare[2], *old[2], *old_spare[2];
+
+	for (int i = 0; i < 2; i++) {
+		skb[i] = prp_build_sup(prp, priv->ports[i].lan);
+		if (!skb[i]) {
+			if (i)
+				kfree_skb(skb[0]);
+			return -ENOMEM;
+		}
+	}
+	/* prp_sup_refill() tries again if this fails */
+	for (int i = 0; i < 2; i++)
+		spare[i] = skb_copy(skb[i], GFP_KERNEL);
+
+	spin_lock_bh(&priv->sup_lock);
+	for (int i = 0; i < 2; i++) {
+		old[i] = priv->sup_skb[i];
+		old_spare[i] = priv->sup_spare[i];
+		priv->sup_skb[i] = skb[i];
+		priv->sup_spare[i] = spare[i];
+	}
+	spin_unlock_bh(&priv->sup_lock);
+
+	/* prp_sup_refill() may still hold a reference */
+	for (int i = 0; i < 2; i++) {
+		kfree_skb(old[i]);
+		kfree_skb(old_spare[i]);
+	}
+	return 0;
+}
+
+/* Free the supervision frames of @prp; prp_sched_del() was called by now */
+void prp_sup_free(struct net_device *prp)
+{
+	struct prp_priv *priv = netdev_priv(prp);
+
+	for (int i = 0; i < 2; i++) {
+		kfree_skb(priv->sup_skb[i]);
+		priv->sup_skb[i] = NULL;
+		kfree_skb(priv->sup_spare[i]);
+		priv->sup_spare[i] = NULL;
+	}
+}
+
+/*
+ * Copy the supervision frames of @priv whose spare was sent, for the next
+ * interval. Allocates with GFP_KERNEL, outside of @priv->sup_lock; a copy of
+ * a frame that prp_sup_rebuild() replaced in the meantime is dropped.
+ */
+static void prp_sup_refill(struct prp_priv *priv)
+{
+	struct sk_buff *tpl, *skb;
+
+	for (int i = 0; i < 2; i++) {
+		spin_lock_bh(&priv->sup_lock);
+		tpl = priv->sup_spare[i] || !priv->sup_skb[i] ?
+		      NULL : skb_get(priv->sup_skb[i]);
+		spin_unlock_bh(&priv->sup_lock);
+		if (!tpl)
+			continue;
+
+		skb = skb_copy(tpl, GFP_KERNEL);
+		spin_lock_bh(&priv->sup_lock);
+		if (priv->sup_skb[i] == tpl && !priv->sup_spare[i]) {
+			priv->sup_spare[i] = skb;
+			skb = NULL;
+		}
+		spin_unlock_bh(&priv->sup_lock);
+		kfree_skb(skb);
+		consume_skb(tpl);
+	}
+}
+
+/**
+ * prp_send_supervision: Called every LIFE_CHECK_INTERVAL, see prp_sched.c.
+ * 	Send a PRP supervision frame through both slaves. The frames are
+ * 	built beforehand by prp_sup_rebuild(), and each slave gets the spare
+ * 	copy of its frame with the sequence numbers written in, so there is
+ * 	no allocation or node table lookup under @priv->sup_lock. Nothing a
+ * 	qdisc, tc action or tap does to a sent frame reaches the template.
+ * 	The spares are copied again afterwards, see prp_sup_refill(); if
+ * 	that failed, the LAN misses one interval.
+ */
+void prp_send_supervision(struct net_device *prp)
+{
+	struct prp_priv *priv = netdev_priv(prp);
+	struct prp_sup_tag *tag;
+	struct prp_rct *rct;
+	struct sk_buff *skb;
+	bool sent = false;
+	u16 sup_seqnr, seqnr;
+	unsigned int len;
+	int res;
+
+	/* Process context; BHs off for the per-CPU stats and seqnr block too */
+	spin_lock_bh(&priv->sup_lock);
+	if (unlikely(!priv->sup_skb[0]))
+		goto out;
+
+	sup_seqnr = atomic_fetch_add(1, &priv->sup_seqnr) & 0xffff;
+	seqnr = prp_next_seqnr(priv, this_cpu_ptr(priv->tx_batches));
+	trace_prp_tx_duplicate(prp, priv->sup_skb[0], seqnr);
+	len = priv->sup_skb[0]->len - PRP_RCTLEN;
+	for (int i = 0; i < 2; i++) {
+		struct prp_port *port = &priv->ports[i];
+
+		if (unlikely(!is_up(port->dev)))
+			continue;
+		skb = priv->sup_spare[i];
+		if (unlikely(!skb))
+			continue;
+		priv->sup_spare[i] = NULL;
+
+		tag = (struct prp_sup_tag *)(skb_mac_header(skb) + ETH_HLEN);
+		tag->tag.sup_seqnr = htons(sup_seqnr);
+		rct = (struct prp_rct *)(skb_tail_pointer(skb) - PRP_RCTLEN);
+		rct->seqnr = htons(seqnr);
+
+		skb->dev = port->dev;
+		res = dev_queue_xmit(skb);
+		if (net_xmit_eval(res))
+			continue;
+		prp_stats_lan_inc(priv, port->lan, sent);
+		sent = true;
+	}
+
+	if (sent)
+		prp_stats_tx(priv, len);
+	else
+		dev_core_stats_tx_dropped_inc(prp);
+out:
+	spin_unlock_bh(&priv->sup_lock);
+	prp_sup_refill(priv);
 }
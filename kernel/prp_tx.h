@@ -4,7 +4,46 @@
 #include <linux/netdevice.h>
 #include <linux/if_ether.h>
 
-void prp_send_skb(struct sk_buff *skb, struct net_device *dev);
+/**
+ * struct prp_tx_batch - Frames waiting to be handed to the slaves.
+ * 	Filled by prp_queue_skb() and emptied by prp_tx_flush(), so that a
+ * 	burst goes to each slave in one go. The master has one per CPU, used
+ * 	with BHs disabled only.
+ * @q: Indexed like prp_priv.ports.
+ * @seq_next: Next sequence number of the block this CPU took, see
+ * 	prp_next_seqnr().
+ * @seq_left: Sequence numbers left in that block.
+ * @seq_time: jiffies at which the block was taken.
+ */
+struct prp_tx_batch {
+	struct sk_buff_head	q[2];
+	u32			seq_next;
+	u32			seq_left;
+	unsigned long		seq_time;
+};
+
+/* Sequence numbers a CPU takes from prp_priv.seqnr at a time */
+#define PRP_SEQNR_BLOCK		8
+
+static inline void prp_tx_batch_init(struct prp_tx_batch *b)
+{
+	__skb_queue_head_init(&b->q[0]);
+	__skb_queue_head_init(&b->q[1]);
+	b->seq_left = 0;
+}
+
+int prp_tx_batches_init(struct net_device *prp);
+
+void prp_tx_batches_destroy(struct net_device *prp);
+
+void prp_queue_skb(struct sk_buff *skb, struct net_device *dev,
+		   struct prp_tx_batch *b);
+
+void prp_tx_flush(struct prp_tx_batch *b, struct net_device *dev);
+
+int prp_sup_rebuild(struct net_device *prp);
+
+void prp_sup_free(struct net_device *prp);
 
 void prp_send_supervision(struct net_device *prp);
 